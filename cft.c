@@ -4,15 +4,26 @@
  *   2. Always parse from the beginning of the data.
  *   3. Always write to the flash when modifying the data.
  *   4. Do not support array.
- *   5. Do not support indefinite data (byte string, string, array, map).
+ *   5. Do not support indefinite data (byte string, string, array, map), except padded values.
  *   6. Do not support optional flags.
  *   7. Do not support fast provisioning. Always prepare provision data offline.
  *   8. Support limited pointer level (configurable).
  */
 
+#define _GNU_SOURCE
 #include "cft.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #define log(fmt, ...)                            \
     do {                                         \
@@ -20,6 +31,38 @@
             fprintf(stderr, fmt, ##__VA_ARGS__); \
     } while (0)
 
+// CBOR major types, as found in the top 3 bits of the initial byte of a data item
+#define CBOR_MAJOR_UINT       0
+#define CBOR_MAJOR_NEGINT     1
+#define CBOR_MAJOR_BYTESTRING 2
+#define CBOR_MAJOR_STRING     3
+#define CBOR_MAJOR_ARRAY      4
+#define CBOR_MAJOR_MAP        5
+#define CBOR_MAJOR_TAG        6
+#define CBOR_MAJOR_SIMPLE     7
+
+struct cbor_head {
+    uint8_t major;    ///< Major type
+    uint8_t info;     ///< Additional information (low 5 bits of the initial byte)
+    uint64_t value;   ///< Argument: the value, length or size, depending on the major type
+    size_t len;       ///< Number of initial bytes, including the argument
+    bool indefinite;  ///< Indefinite length string or byte string, that is a padded value
+};
+
+// A padded value is an indefinite length string (or byte string) made of one chunk holding the value,
+// then empty chunks reserving room for the value to grow, then the break: 7f 63 'a' 'b' 'c' 60 60 60 ff.
+// Any CBOR decoder reads it as the plain value, and cft_set_sz can rewrite it in place as long as the
+// new value fits in it.
+struct cbor_slot {
+    uint8_t major;    ///< Major type of the value (string or byte string)
+    size_t head_len;  ///< Length of the indefinite initial byte and of the initial bytes of the chunk
+    size_t length;    ///< Length of the value
+    size_t pad;       ///< Number of empty chunks after the value
+    size_t len;       ///< Encoded length of the whole padded value, including the break
+};
+
+#define CBOR_BREAK 0xff
+
 static int _pow(int b, int ex) {
     if (ex == 0)
         return 1;
@@ -29,56 +72,157 @@ static int _pow(int b, int ex) {
     return res;
 }
 
-static void enc_value(void* context);
+static bool push(cft_context_t* ctx, const container_context_t* element) {
+    if (ctx->stack_top + 1 == ctx->stack_size) {
+        int size = ctx->stack_size * 2;
+        container_context_t* stack = realloc(ctx->stack, size * sizeof(container_context_t));
+        if (stack == NULL) {
+            ctx->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "fail to grow the container context stack to %d levels", size);
+            return false;
+        }
+
+        ctx->stack = stack;
+        ctx->stack_size = size;
+    }
 
+    ctx->stack[++ctx->stack_top] = *element;
+    return true;
+}
 
-static void push(container_context_t* element, struct container_context stack[], int stackSize, int* top) {
-    if (*top == -1) {
-        memset(&stack[stackSize - 1], 0, sizeof(container_context_t));
-        stack[stackSize - 1].type = element->type;
-        stack[stackSize - 1].size = element->size;
-        stack[stackSize - 1].current_index = element->current_index;
-        stack[stackSize - 1].should_ignore = element->should_ignore;
-        strncpy(stack[stackSize - 1].map_pointer, element->map_pointer, MAX_POINTER_LEN);
-        memset(stack[stackSize - 1].key, 0, sizeof(stack[stackSize - 1].key));
-        *top = stackSize - 1;
-    } else if (*top == 0) {
-        log("The stack is already full. \n");
+static void pop(cft_context_t* ctx) {
+    if (ctx->stack_top == -1) {
+        log("The container context stack is empty. \n");
     } else {
-        memset(&stack[(*top) - 1], 0, sizeof(container_context_t));
-        stack[(*top) - 1].type = element->type;
-        stack[(*top) - 1].size = element->size;
-        stack[(*top) - 1].current_index = element->current_index;
-        stack[(*top) - 1].should_ignore = element->should_ignore;
-        strncpy(stack[(*top) - 1].map_pointer, element->map_pointer, MAX_POINTER_LEN);
-        memset(stack[(*top) - 1].key, 0, sizeof(stack[(*top) - 1].key));
-        (*top)--;
+        container_context_t* cc = &ctx->stack[ctx->stack_top];
+        log("container context popped: type=%d, size=%" PRIu64 ", current_index=%d, map_pointer=%.*s\n", cc->type, cc->size,
+            cc->current_index, (int)cc->path_len, ctx->key_path);
+        ctx->stack_top--;
     }
 }
 
-static void pop(struct container_context stack[], int stackSize, int* top) {
-    if (*top == -1) {
-        log("The container context stack is empty. \n");
+static container_context_t* get_top(cft_context_t* ctx) {
+    if (ctx->stack_top == -1) {
+        return NULL;
+    }
+
+    return &(ctx->stack[ctx->stack_top]);
+}
+
+// Make sure key_path can hold size bytes.
+static bool reserve_key_path(cft_context_t* ctx, size_t size) {
+    if (size <= ctx->key_path_size) {
+        return true;
+    }
+
+    size_t new_size = ctx->key_path_size * 2;
+    while (new_size < size) {
+        new_size *= 2;
+    }
+
+    char* key_path = realloc(ctx->key_path, new_size);
+    if (key_path == NULL) {
+        ctx->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "fail to grow the key path buffer to %" PRIu64 " bytes", new_size);
+        return false;
+    }
+
+    ctx->key_path = key_path;
+    ctx->key_path_size = new_size;
+    return true;
+}
+
+// Store the current key of a map right after the map pointer in key_path.
+static bool set_key(cft_context_t* ctx, container_context_t* cc, const void* key, size_t len) {
+    // Leave room for the '/' a nested map would append
+    if (!reserve_key_path(ctx, cc->path_len + len + 1)) {
+        return false;
+    }
+
+    memcpy(ctx->key_path + cc->path_len, key, len);
+    cc->key_len = len;
+    cc->has_key = true;
+    return true;
+}
+
+// Fill in the context of a map nested under the current key of its parent, or of the root map.
+static void init_map_context(cft_context_t* ctx, const container_context_t* parent, container_context_t* cc) {
+    if (parent == NULL) {
+        ctx->key_path[0] = '/';
+        cc->path_len = 1;
+        cc->on_path = true;
+        cc->depth = 0;
     } else {
-        log("container context popped: type=%d, size=%" PRIu64 ", current_index=%d, map_pointer=%s\n", stack[(*top)].type, stack[(*top)].size,
-            stack[(*top)].current_index, stack[(*top)].map_pointer);
+        cc->path_len = parent->path_len + parent->key_len + 1;
+        ctx->key_path[cc->path_len - 1] = '/';
+        cc->on_path = parent->keep_searching;
+        cc->depth = parent->depth + 1;
+    }
+}
 
-        // If the element popped was the last element in the stack
-        // then set top to -1 to show that the stack is empty
-        if ((*top) == stackSize - 1) {
-            (*top) = -1;
-        } else {
-            (*top)++;
+// Pop every complete map on the top of the stack. A map that has been popped is itself a
+// complete value of its parent map, so the parent may become complete in turn.
+static void pop_complete_maps(cft_context_t* ctx, bool keep_searching) {
+    container_context_t* cur_cc = get_top(ctx);
+    while (cur_cc != NULL && cur_cc->current_index >= cur_cc->size) {
+        pop(ctx);
+
+        // Get the parent container context of the map we just left
+        container_context_t* parent_cc = get_top(ctx);
+        if (parent_cc == NULL) {
+            break;
+        }
+
+        if (parent_cc->keep_searching && !keep_searching) {
+            // If we can reach here, it means that the parent key exists in the user pointer, but the current
+            // key doesn't exist in the map.
+            // This is a very important information, because we know that we need to insert new key/value pair
+            // into this map. Store the pointer somewhere so we know we reach this key when we re-parse the data.
+            if (cur_cc->path_len <= MAX_POINTER_LEN) {
+                memset(ctx->insertion_map_pointer, 0, sizeof(ctx->insertion_map_pointer));
+                memcpy(ctx->insertion_map_pointer, ctx->key_path, cur_cc->path_len);
+                ctx->insertion_depth = cur_cc->depth;
+            }
         }
+
+        keep_searching = parent_cc->keep_searching;
+        parent_cc->has_key = false;  // critical to search the next key in the parent map
+        parent_cc->current_index++;
+        cur_cc = parent_cc;
     }
 }
 
-static container_context_t* get_top(struct container_context stack[], int stackSize, int top) {
-    if (top == -1) {
-        return NULL;
+// Account for a complete value in the current map.
+static void finish_value(cft_context_t* ctx) {
+    container_context_t* cur_cc = get_top(ctx);
+    bool keep_searching = cur_cc->keep_searching;
+
+    // Because this is a value, we need to clear the key so that the next time we see a string, we will know it is a key.
+    cur_cc->has_key = false;
+
+    cur_cc->current_index++;
+    pop_complete_maps(ctx, keep_searching);
+}
+
+// Check whether a key of the given map is the segment of the pointer at the depth of the map,
+// that is whether the key leads to the pointer.
+static bool key_on_path(const cft_context_t* ctx, const container_context_t* cc, const char* key, size_t len) {
+    const cft_pointer_t* p = ctx->pointer;
+    if (!cc->on_path || cc->depth >= p->depth) {
+        return false;
     }
 
-    return &(stack[top]);
+    return p->seg_len[cc->depth] == len && memcmp(p->str + p->seg_off[cc->depth], key, len) == 0;
+}
+
+// Check whether the current key of the given map is the pointer itself.
+static bool key_is_pointer(const cft_context_t* ctx, const container_context_t* cc) {
+    return cc->keep_searching && cc->depth == ctx->pointer->depth - 1;
+}
+
+// Length of the pointer prefix ending with the segment at the given depth.
+static int pointer_prefix_len(const cft_pointer_t* p, int depth) {
+    return p->seg_off[depth] + p->seg_len[depth];
 }
 
 static void dec_map_start_callback(void* context, size_t size) {
@@ -98,27 +242,19 @@ static void dec_map_start_callback(void* context, size_t size) {
     cc.current_index = 0;
     cc.keep_searching = false;
 
-    container_context_t* cur_cc = get_top(ctx->stack, MAX_LEVEL, ctx->stack_top);
+    container_context_t* cur_cc = get_top(ctx);
     if (cur_cc == NULL) {
-        strcpy(cc.map_pointer, "/");
         cc.should_ignore = false;
     } else {
         // Check if the specified pointer is a map.
         // If it is a map, then return syntax error, because we should not
         // specify a map. We should specify a key.
-        char tmp_pointer[MAX_POINTER_LEN] = {0};
-        strcpy(tmp_pointer, cur_cc->map_pointer);
-        strcat(tmp_pointer, cur_cc->key);
-        if (strcmp(ctx->pointer, tmp_pointer) == 0) {
+        if (key_is_pointer(ctx, cur_cc)) {
             ctx->err = CFT_ERR_POINTER_IS_MAP;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "pointer \"%s\" should not be a map", ctx->pointer);
+            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "pointer \"%s\" should not be a map", ctx->pointer->str);
             return;
         }
 
-        strcpy(cc.map_pointer, cur_cc->map_pointer);
-        strcat(cc.map_pointer, cur_cc->key);
-        strcat(cc.map_pointer, "/");
-
         // Before we dive into the map, do we really need to check the map content?
         // If the current map should already be ignored, we should ignore the coming map, too.
         // If the current map should not be ignored, we should check the current key.
@@ -128,11 +264,26 @@ static void dec_map_start_callback(void* context, size_t size) {
         } else {
             cc.should_ignore = cur_cc->keep_searching ? false : true;
         }
+
+        if (cc.should_ignore) {
+            // Nothing inside this map can match the pointer, so don't dive into it. Let the decode
+            // loop jump over its keys and values, and count the map as one value of the current map.
+            ctx->skip_value = true;
+            ctx->skip_count = 2 * size;
+            return;
+        }
+    }
+
+    init_map_context(ctx, cur_cc, &cc);
+    if (!push(ctx, &cc)) {
+        return;
     }
 
-    push(&cc, ctx->stack, MAX_LEVEL, &(ctx->stack_top));
+    log("==> map start, size = %" PRIu64 ", map_pointer = %.*s\n", size, (int)cc.path_len, ctx->key_path);
 
-    log("==> map start, size = %" PRIu64 ", map_pointer = %s\n", size, cc.map_pointer);
+    if (size == 0) {
+        pop_complete_maps(ctx, false);
+    }
 }
 
 static bool dec_prepare_context_for_value(void* context, size_t length) {
@@ -141,68 +292,36 @@ static bool dec_prepare_context_for_value(void* context, size_t length) {
         return false;
     }
 
-    if (length > ctx->data_size) {
-        ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for value (%" PRIu64 " bytes)", length);
-        return false;
-    }
-
-    container_context_t* cur_cc = get_top(ctx->stack, MAX_LEVEL, ctx->stack_top);
+    container_context_t* cur_cc = get_top(ctx);
     if (!cur_cc) {
         ctx->err = CFT_ERR_MALFORMATED_DATA;
         snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "the value is not inside a map\n");
         return false;
     }
 
-    memset(ctx->item.data, 0, ctx->data_size);
-
     // If this item is a key
 
-    if (strlen(cur_cc->key) == 0) {
+    if (!cur_cc->has_key) {
         ctx->err = CFT_ERR_MALFORMATED_DATA;
         snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "the value cannot be a key\n");
         return false;
     }
 
     // If this item is a value
-    char tmp_pointer[MAX_POINTER_LEN] = {0};
-    strcpy(tmp_pointer, cur_cc->map_pointer);
-    strcat(tmp_pointer, cur_cc->key);
-    if (cur_cc->keep_searching && strcmp(ctx->pointer, tmp_pointer) != 0) {
+    if (cur_cc->keep_searching && !key_is_pointer(ctx, cur_cc)) {
         // If we are searching /b/f/k, but /b/f is a key for an integer, not a map, it means the pointer specified by user is wrong.
         // It is either the original CBOR data structure is wrong (/b/f should be a map, not an integer),
         // or user is wrong (should not expect /b/f to be a map).
         // We consider this a syntax error - a data type mismatch error.
         ctx->err = CFT_ERR_WRONG_DATA_TYPE;
-        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%s\" should be a map", tmp_pointer);
+        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%.*s\" should be a map", pointer_prefix_len(ctx->pointer, cur_cc->depth),
+                 ctx->pointer->str);
         return false;
     }
 
-    // Because this is a value, we need to clear the key so that the next time we see a string, we will know it is a key.
-    memset(cur_cc->key, 0, sizeof(cur_cc->key));
-
     bool keep_searching = cur_cc->keep_searching;
     bool should_ignore = cur_cc->should_ignore;
-
-    cur_cc->current_index++;
-    if (cur_cc->current_index >= cur_cc->size) {
-        // This is the last value in the map, so we're going to pop up the container context
-        pop(ctx->stack, MAX_LEVEL, &(ctx->stack_top));
-
-        // Get the parent container context of the current value
-        container_context_t* parent_cc = get_top(ctx->stack, MAX_LEVEL, ctx->stack_top);
-        if (parent_cc) {
-            memset(parent_cc->key, 0, sizeof(parent_cc->key));  // critical to search the next key in the parent map
-
-            if (parent_cc->keep_searching && !keep_searching) {
-                // If we can reach here, it means that the parent key exists in the user pointer, but the current
-                // key doesn't exist in the map.
-                // This is a very important information, because we know that we need to insert new key/value pair
-                // into this map. Store the pointer somewhere so we know we reach this key when we re-parse the data.
-                strcpy(ctx->insertion_map_pointer, cur_cc->map_pointer);
-            }
-        }
-    }
+    finish_value(ctx);
 
     // The values in the current map should be ignored, because the key of the map is not what we're looking for.
     // We don't need this value, because the key of it is not what we're looking for.
@@ -210,6 +329,13 @@ static bool dec_prepare_context_for_value(void* context, size_t length) {
         return false;
     }
 
+    // Only the value we're looking for is written to the output buffer
+    if (length > ctx->data_size && !ctx->view) {
+        ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
+        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for value (%" PRIu64 " bytes)", length);
+        return false;
+    }
+
     return true;
 }
 
@@ -219,77 +345,49 @@ static void dec_string_callback(void* context, cbor_data data, size_t length) {
         return;
     }
 
-    if (length >= ctx->data_size) {
-        ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for the string (%" PRIu64 " bytes)", length);
-        return;
-    }
-
-    container_context_t* cur_cc = get_top(ctx->stack, MAX_LEVEL, ctx->stack_top);
+    container_context_t* cur_cc = get_top(ctx);
     if (cur_cc == NULL) {
         ctx->err = CFT_ERR_MALFORMATED_DATA;
         snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "the value is not inside a map\n");
         return;
     }
 
-    memset(ctx->item.data, 0, ctx->data_size);
-
     // If this string is a key
 
-    if (strlen(cur_cc->key) == 0) {
-        memset(cur_cc->key, 0, sizeof(cur_cc->key));
-        memcpy(cur_cc->key, data, length);
-
-        char tmp_pointer[MAX_POINTER_LEN] = {0};
-        strcpy(tmp_pointer, cur_cc->map_pointer);
-        strcat(tmp_pointer, cur_cc->key);
-        if (strstr(ctx->pointer, tmp_pointer) == ctx->pointer) {
+    if (!cur_cc->has_key) {
+        if (key_on_path(ctx, cur_cc, (const char*)data, length)) {
+            // Only the keys on the path are kept, because only their values are decoded
+            if (!set_key(ctx, cur_cc, data, length)) {
+                return;
+            }
             cur_cc->keep_searching = true;
         } else {
+            // The value of this key can't lead to the pointer. Let the decode loop jump over it,
+            // including its whole subtree if it is a map, without dispatching any callback.
+            cur_cc->has_key = true;
+            cur_cc->key_len = 0;
             cur_cc->keep_searching = false;
+            ctx->skip_value = true;
+            ctx->skip_count = 1;
         }
         return;
     }
 
     // If this string is a value
-    char tmp_pointer[MAX_POINTER_LEN] = {0};
-    strcpy(tmp_pointer, cur_cc->map_pointer);
-    strcat(tmp_pointer, cur_cc->key);
-    if (cur_cc->keep_searching && strcmp(ctx->pointer, tmp_pointer) != 0) {
+    if (cur_cc->keep_searching && !key_is_pointer(ctx, cur_cc)) {
         // If we are searching /b/f/k, but /b/f is a key for an integer, not a map, it means the pointer specified by user is wrong.
         // It is either the original CBOR data structure is wrong (/b/f should be a map, not an integer),
         // or user is wrong (should not expect /b/f to be a map).
         // We consider this a syntax error - a data type mismatch error.
         ctx->err = CFT_ERR_WRONG_DATA_TYPE;
-        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%s\" should be a map", tmp_pointer);
+        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%.*s\" should be a map", pointer_prefix_len(ctx->pointer, cur_cc->depth),
+                 ctx->pointer->str);
         return;
     }
 
-    // Because this is a value, we need to clear the key so that the next time we see a string, we will know it is a key.
-    memset(cur_cc->key, 0, sizeof(cur_cc->key));
-
     bool keep_searching = cur_cc->keep_searching;
     bool should_ignore = cur_cc->should_ignore;
-
-    cur_cc->current_index++;
-    if (cur_cc->current_index >= cur_cc->size) {
-        // This is the last value in the map, so we're going to pop up the container context
-        pop(ctx->stack, MAX_LEVEL, &(ctx->stack_top));
-
-        // Get the parent container context of the current value
-        container_context_t* parent_cc = get_top(ctx->stack, MAX_LEVEL, ctx->stack_top);
-        if (parent_cc) {
-            memset(parent_cc->key, 0, sizeof(parent_cc->key));  // critical
-
-            if (parent_cc->keep_searching && !keep_searching) {
-                // If we can reach here, it means that the parent key exists in the user pointer, but the current
-                // key doesn't exist in the map.
-                // This is a very important information, because we know that we need to insert new key/value pair
-                // into this map. Store the pointer somewhere so we know we reach this key when we re-parse the data.
-                strcpy(ctx->insertion_map_pointer, cur_cc->map_pointer);
-            }
-        }
-    }
+    finish_value(ctx);
 
     // We don't need this value, because it's not what we're looking for
     if (should_ignore || !keep_searching) {
@@ -297,10 +395,27 @@ static void dec_string_callback(void* context, cbor_data data, size_t length) {
     }
 
     // We need this value, because it's what we're looking for
+    if (ctx->view) {
+        // Leave the string where it is, the caller gets a view of it
+        ctx->item.type = CBOR_TYPE_STRING;
+        ctx->item.metadata.string_metadata.type = _CBOR_METADATA_DEFINITE;
+        ctx->item.metadata.string_metadata.length = length;
+        ctx->view_data = data;
+        ctx->pointer_found = true;
+        return;
+    }
+
+    if (length >= ctx->data_size) {
+        ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
+        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for the string (%" PRIu64 " bytes)", length);
+        return;
+    }
+
     ctx->item.type = CBOR_TYPE_STRING;
     ctx->item.metadata.string_metadata.type = _CBOR_METADATA_DEFINITE;
     ctx->item.metadata.string_metadata.length = length;
     memcpy(ctx->item.data, data, length);
+    ctx->item.data[length] = 0;
     ctx->pointer_found = true;
     log("==> string (value) = %s\n", (char*)ctx->item.data);
 }
@@ -418,8 +533,14 @@ static void dec_byte_string_callback(void* context, cbor_data data, size_t lengt
     ctx->item.type = CBOR_TYPE_BYTESTRING;
     ctx->item.metadata.bytestring_metadata.type = _CBOR_METADATA_DEFINITE;
     ctx->item.metadata.bytestring_metadata.length = length;
-    memcpy(ctx->item.data, data, length);
     ctx->pointer_found = true;
+    if (ctx->view) {
+        // Leave the bytes where they are, the caller gets a view of them
+        ctx->view_data = data;
+        return;
+    }
+
+    memcpy(ctx->item.data, data, length);
 
     log("==> bytes =");
     for (int i = 0; i < length; i++) {
@@ -456,13 +577,13 @@ static void dec_float4_callback(void* context, float value) {
 
 static void dec_float8_callback(void* context, double value) {
     cft_context_t* ctx = context;
-    if (!dec_prepare_context_for_value(ctx, sizeof(float))) {
+    if (!dec_prepare_context_for_value(ctx, sizeof(double))) {
         return;
     }
 
     ctx->item.type = CBOR_TYPE_FLOAT_CTRL;
     ctx->item.metadata.float_ctrl_metadata.width = CBOR_FLOAT_64;
-    memcpy(ctx->item.data, &value, sizeof(float));
+    memcpy(ctx->item.data, &value, sizeof(double));
     ctx->pointer_found = true;
     log("==> float8 = %f\n", *((double*)ctx->item.data));
 }
@@ -584,1408 +705,4626 @@ static void dec_indef_break_callback(void* context) {
 
 ////////////////////////////////////////////////////////////////////////////////
 
-char* get_newkey_toinsert(char* pointer)
-{
-    char* p = strrchr(pointer, '/'); // /a/b/c/d --> d is the new key to be inserted
-    return (p+1);
-}
-
-
-void enc_map_start_callback(void* context, size_t size) {
-    cft_context_t* ctx = context;
-    if (ctx->err != CFT_ERR_OK) {
-        return;
+// Write the buffered bytes, then len bytes of data, to the output file with as few write calls as possible.
+static bool flush_output(cft_context_t* h, const void* data, size_t len) {
+    cft_writer_t* out = &h->out;
+    struct iovec iov[2] = {{out->buf, out->len}, {(void*)data, len}};
+    int i = 0;
+    while (i < 2 && iov[i].iov_len == 0) {
+        i++;
     }
 
-    struct container_context cc = {0};
-    cc.type = CBOR_TYPE_MAP;
-    cc.size = size;
-    cc.current_index = 0;
-    cc.keep_searching = false;
-
-    container_context_t* cur_cc = get_top(ctx->stack, MAX_LEVEL, ctx->stack_top);
-    if (cur_cc == NULL) {
-        strcpy(cc.map_pointer, "/");
-        cc.should_ignore = false;
-    } else {
-        // Check if the specified pointer is a map.
-        // If it is a map, then return syntax error, because we should not
-        // specify a map. We should specify a key.
-        char tmp_pointer[MAX_POINTER_LEN] = {0};
-        strcpy(tmp_pointer, cur_cc->map_pointer);
-        strcat(tmp_pointer, cur_cc->key);
-        if (strcmp(ctx->pointer, tmp_pointer) == 0) {
-            if (!ctx->erase) {
-                ctx->err = CFT_ERR_POINTER_IS_MAP;
-                snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "pointer \"%s\" should not be a map", ctx->pointer);
-                return;
-            }
+    while (i < 2) {
+        ssize_t n = writev(out->fd, iov + i, 2 - i);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
 
-            cc.should_ignore = true;
+        if (n <= 0) {
+            h->err = CFT_ERR_WRITE_FILE_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to write the new CBOR data of \"%s\"", h->path);
+            return false;
         }
 
-        strcpy(cc.map_pointer, cur_cc->map_pointer);
-        strcat(cc.map_pointer, cur_cc->key);
-        strcat(cc.map_pointer, "/");
+        out->flush_count++;
+        out->bytes_flushed += n;
+        size_t left = n;
+        while (i < 2 && left >= iov[i].iov_len) {
+            left -= iov[i].iov_len;
+            i++;
+        }
 
-        // Before we dive into the map, do we really need to encode and write the map content?
-        // If the current map should already be ignored, we should ignore the coming map, too.
-        // If the current map should not be ignored, we should check the current key.
-        // If the current key is not what we are looking for, we should ignore the coming map.
-        if (cur_cc->should_ignore) {
-            cc.should_ignore = true;
+        if (i < 2) {
+            iov[i].iov_base = (uint8_t*)iov[i].iov_base + left;
+            iov[i].iov_len -= left;
         }
     }
 
-    // Notice that, when we plan to remove an item from the map, the size of the map pushed to
-    // the container context stack should be the original value, or the last element in the map
-    // won't see the correct container context, because it will be popped out just before we see
-    // the last element.
-    push(&cc, ctx->stack, MAX_LEVEL, &(ctx->stack_top));
-
-    if (cc.should_ignore) {
-        return;
-    }
+    out->len = 0;
+    return true;
+}
 
-    if (!ctx->erase && !ctx->set && strcmp(cc.map_pointer, ctx->insertion_map_pointer) == 0) {
-        // If inserting new key, set insert flag to true and increase the size of the map.
-        ctx->insert = true;
-        cc.size++;
-    }
+// Append len bytes of data to the output. Data too large for the buffer goes to the file along with it.
+static bool write_output(cft_context_t* h, const void* data, size_t len) {
+    cft_writer_t* out = &h->out;
+    out->bytes_written += len;
+    if (out->len + len > out->size) {
+        if (len >= out->size) {
+            return flush_output(h, data, len);
+        }
 
-    if (ctx->erase && strcmp(cc.map_pointer, ctx->insertion_map_pointer) == 0) {
-        // Before erasing an item, we will first search the item. If the item exists,
-        // we will store its parent pointer in the insertion_map_pointer variable, and
-        // start to look for the item from the beginning of the cbor data again.
-        // If the current map pointer is the insertion_map_pointer, it means we have
-        // reached the parent map of the item that we want to delete. In this case, we
-        // should decrease the parent map size by one, and then encode the parent map
-        // starting byte.
-        cc.size--;
+        if (!flush_output(h, NULL, 0)) {
+            return false;
+        }
     }
 
-    log("==> map start, size = %" PRIu64 ", map_pointer = %s\n", cc.size, cc.map_pointer);
-
-    unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-    size_t written = cbor_encode_map_start(cc.size, buf, sizeof(buf));
-    fwrite(buf, written, 1, ctx->fdw);
-    ctx->bytes_written += written;
-
-    if (ctx->insert)
-    {
-        char cftpointer[MAX_POINTER_LEN + 1] = {0}; // to copy ctx->pointer for strtok
-        memcpy(cftpointer, ctx->pointer, strlen(ctx->pointer));
-
-        char* token = strtok(cftpointer + strlen(ctx->insertion_map_pointer), "/");
-
-        while (token != NULL)
-        {
-            // If a new key is being inserted into a deep nested map with it's parent keys not
-            // already present in the config tree, we need to iterate and parse all the keys to create
-            // the needed nested map and insert the new key with its value as key-value pair as an
-            // entry to the last nested map.
-            const unsigned char* in_key = token;
-
-            cbor_item_t new_keyitem = {0};
-            char in_keybuf[8] = {0};
-            new_keyitem.type = CBOR_TYPE_STRING;
-            new_keyitem.metadata.string_metadata.type = _CBOR_METADATA_DEFINITE;
-            new_keyitem.metadata.string_metadata.length = strlen(in_key);
-            new_keyitem.data = in_keybuf;
-            memset(new_keyitem.data, 0, sizeof(in_keybuf));
-            memcpy(new_keyitem.data, in_key, strlen(in_key));
-
-            unsigned char buf_key[MAX_INIT_BYTES_LEN] = {0};
-            size_t written_key = cbor_encode_string_start(cbor_string_length(&new_keyitem), buf_key, sizeof(buf_key));
-            if (written_key == 0) {
-                ctx->err = CFT_ERR_INSUFFICIENT_INIT_BYTES_BUFFER;
-                snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for string initial bytes");
-                return;
-            }
-
-            fwrite(buf_key, written_key, 1, ctx->fdw);
-            fwrite(cbor_string_handle(&new_keyitem), cbor_string_length(&new_keyitem), 1, ctx->fdw);
-            ctx->bytes_written += written_key;
-            ctx->bytes_written += cbor_string_length(&new_keyitem);
-            log("==> set string key = %s\n", cbor_string_handle(&new_keyitem));
-
-            if (strcmp(get_newkey_toinsert(ctx->pointer), token) != 0)
-            {
-                unsigned char buf_n[MAX_INIT_BYTES_LEN] = {0};
-                size_t written = cbor_encode_map_start(1, buf_n, sizeof(buf_n));
-                fwrite(buf_n, written, 1, ctx->fdw);
-                ctx->bytes_written += written;
-            }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return true;
+}
 
-            token = strtok(NULL, "/");
+// Append count copies of the byte to the output.
+static bool fill_output(cft_context_t* h, uint8_t byte, size_t count) {
+    uint8_t chunk[64];
+    memset(chunk, byte, sizeof(chunk));
+    while (count > 0) {
+        size_t n = count < sizeof(chunk) ? count : sizeof(chunk);
+        if (!write_output(h, chunk, n)) {
+            return false;
         }
-
-        enc_value(ctx);
-        ctx->insert = false;
+        count -= n;
     }
-}
 
-static bool enc_prepare_context_for_value(void* context, bool* write_new_value) {
-    cft_context_t* ctx = context;
-    if (ctx->err != CFT_ERR_OK) {
-        return false;
-    }
+    return true;
+}
 
-    container_context_t* cur_cc = get_top(ctx->stack, MAX_LEVEL, ctx->stack_top);
-    if (!cur_cc) {
-        ctx->err = CFT_ERR_MALFORMATED_DATA;
-        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "the value is not inside a map\n");
-        return false;
+// Start writing new CBOR data to the file.
+static bool open_output(cft_context_t* h, int fd) {
+    cft_writer_t* out = &h->out;
+    if (out->buf == NULL && out->size > 0) {
+        out->buf = malloc(out->size);
+        if (out->buf == NULL) {
+            h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate write buffer");
+            return false;
+        }
     }
 
-    // If this item is a key
+    out->fd = fd;
+    out->len = 0;
+    out->bytes_written = 0;
+    out->bytes_flushed = 0;
+    out->flush_count = 0;
+    out->bytes_copied = 0;
+    return true;
+}
 
-    if (strlen(cur_cc->key) == 0) {
-        ctx->err = CFT_ERR_MALFORMATED_DATA;
-        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "the value cannot be a key\n");
-        return false;
+// Write what is left in the buffer and close the file, unless the rewrite already failed.
+// The data is synced first unless the context doesn't care about durability.
+static bool close_output(cft_context_t* h) {
+    cft_writer_t* out = &h->out;
+    bool ok = h->err == CFT_ERR_OK && flush_output(h, NULL, 0);
+    bool synced = !ok || h->durability == CFT_DURABILITY_NONE || fdatasync(out->fd) == 0;
+    if ((close(out->fd) != 0 || !synced) && ok) {
+        h->err = CFT_ERR_WRITE_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to write the new CBOR data of \"%s\"", h->path);
+        ok = false;
     }
 
-    // If this item is a value
-
-    // Check if we need to write a new value
-    char tmp_pointer[MAX_POINTER_LEN] = {0};
-    strcpy(tmp_pointer, cur_cc->map_pointer);
-    strcat(tmp_pointer, cur_cc->key);
-    *write_new_value = strcmp(ctx->pointer, tmp_pointer) == 0 ? true : false;
-
-    // Because this is a value, we need to clear the key so that the next time we see a string, we will know it is a key.
-    memset(cur_cc->key, 0, sizeof(cur_cc->key));
-
-    bool should_ignore = cur_cc->should_ignore;
-    cur_cc->current_index++;
-    if (cur_cc->current_index >= cur_cc->size) {
-        // This is the last value in the map, so we're going to pop up the container context
-        pop(ctx->stack, MAX_LEVEL, &(ctx->stack_top));
+    out->fd = -1;
+    out->len = 0;
+    return ok;
+}
 
-        // Get the parent container context of the current value
-        struct container_context* parent_cc = get_top(ctx->stack, MAX_LEVEL, ctx->stack_top);
-        if (parent_cc) {
-            memset(parent_cc->key, 0, sizeof(parent_cc->key));  // critical to search the next key in the parent map
-        }
+// Encode the initial bytes of a padded value of the given length: the indefinite initial byte, then the
+// initial bytes of the chunk holding the value. The value, the padding and the break come after them.
+static size_t encode_slot_start(uint8_t major, size_t length, unsigned char* buf, size_t size) {
+    if (size == 0) {
+        return 0;
     }
 
-    return should_ignore ? false : true;
+    buf[0] = major << 5 | 31;
+    size_t written = major == CBOR_MAJOR_STRING ? cbor_encode_string_start(length, buf + 1, size - 1)
+                                                : cbor_encode_bytestring_start(length, buf + 1, size - 1);
+    return written == 0 ? 0 : written + 1;
 }
 
-static void enc_value(void* context) {
-    cft_context_t* ctx = context;
-    if ((ctx->err != CFT_ERR_OK || ctx->erase || !ctx->insert) && (!ctx->set)) {
-        return;
+// Write the initial bytes of a string or byte string value of the given length, padded if pad isn't 0.
+static bool write_slot_head(cft_context_t* ctx, uint8_t major, size_t length, size_t pad) {
+    unsigned char buf[MAX_INIT_BYTES_LEN + 1] = {0};
+    size_t written = 0;
+    if (pad > 0) {
+        written = encode_slot_start(major, length, buf, sizeof(buf));
+    } else if (major == CBOR_MAJOR_STRING) {
+        written = cbor_encode_string_start(length, buf, sizeof(buf));
+    } else {
+        written = cbor_encode_bytestring_start(length, buf, sizeof(buf));
     }
 
-    cbor_item_t* i = &ctx->item;
-    switch (cbor_typeof(i)) {
-        case CBOR_TYPE_UINT: {
-            unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-            size_t written = 0;
-            switch (cbor_int_get_width(i)) {
-                case CBOR_INT_8: {
-                    written = cbor_encode_uint8(cbor_get_uint8(i), buf, sizeof(buf));
-                    break;
-                }
-                case CBOR_INT_16: {
-                    written = cbor_encode_uint16(cbor_get_uint16(i), buf, sizeof(buf));
-                    break;
-                }
-                case CBOR_INT_32: {
-                    written = cbor_encode_uint16(cbor_get_uint32(i), buf, sizeof(buf));
-                    break;
-                }
-                case CBOR_INT_64: {
-                    written = cbor_encode_uint64(cbor_get_uint64(i), buf, sizeof(buf));
-                    break;
-                }
-            }
-
-            if (!written) {
-                ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-                snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for uint (%dB)", _pow(2, cbor_int_get_width(i)));
-                return;
-            }
-
-            fwrite(buf, written, 1, ctx->fdw);
-            ctx->bytes_written += written;
-            log("==> set uint (%dB) value = %" PRIu64 "\n", _pow(2, cbor_int_get_width(i)), cbor_get_int(i));
-            break;
-        };
-        case CBOR_TYPE_NEGINT: {
-            unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-            size_t written = 0;
-            switch (cbor_int_get_width(i)) {
-                case CBOR_INT_8: {
-                    written = cbor_encode_negint8(cbor_get_uint8(i), buf, sizeof(buf));
-                    break;
-                }
-                case CBOR_INT_16: {
-                    written = cbor_encode_negint16(cbor_get_uint16(i), buf, sizeof(buf));
-                    break;
-                }
-                case CBOR_INT_32: {
-                    written = cbor_encode_negint16(cbor_get_uint32(i), buf, sizeof(buf));
-                    break;
-                }
-                case CBOR_INT_64: {
-                    written = cbor_encode_negint64(cbor_get_uint64(i), buf, sizeof(buf));
-                    break;
-                }
-            }
-
-            if (!written) {
-                ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-                snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for negint (%dB)", _pow(2, cbor_int_get_width(i)));
-                return;
-            }
-
-            fwrite(buf, written, 1, ctx->fdw);
-            ctx->bytes_written += written;
-            log("==> set negint (%dB) value = -%" PRIu64 "\n", _pow(2, cbor_int_get_width(i)), cbor_get_int(i) + 1);
-            break;
-        };
-        case CBOR_TYPE_BYTESTRING: {
-            if (cbor_bytestring_is_indefinite(i)) {
-                ctx->err = CFT_ERR_CBOR_TYPE_NOT_ALLOWED;
-                snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "indefinite byte string is not supported");
-                return;
-            } else {
-                unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-                size_t written = cbor_encode_bytestring_start(cbor_bytestring_length(i), buf, sizeof(buf));
-                if (written == 0) {
-                    ctx->err = CFT_ERR_INSUFFICIENT_INIT_BYTES_BUFFER;
-                    snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for byte string initial bytes");
-                    return;
-                }
-
-                fwrite(buf, written, 1, ctx->fdw);
-                fwrite(cbor_bytestring_handle(i), cbor_bytestring_length(i), 1, ctx->fdw);
-                ctx->bytes_written += written;
-                ctx->bytes_written += cbor_bytestring_length(i);
-                log("==> set byte string value (%" PRIu64 "B)\n", cbor_bytestring_length(i));
-            }
-            break;
-        };
-        case CBOR_TYPE_STRING: {
-            if (cbor_string_is_indefinite(i)) {
-                ctx->err = CFT_ERR_CBOR_TYPE_NOT_ALLOWED;
-                snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "indefinite string is not supported");
-                return;
-            } else {
-                unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-                size_t written = cbor_encode_string_start(cbor_string_length(i), buf, sizeof(buf));
-                if (written == 0) {
-                    ctx->err = CFT_ERR_INSUFFICIENT_INIT_BYTES_BUFFER;
-                    snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for string initial bytes");
-                    return;
-                }
+    if (written == 0) {
+        ctx->err = CFT_ERR_INSUFFICIENT_INIT_BYTES_BUFFER;
+        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for %s initial bytes",
+                 major == CBOR_MAJOR_STRING ? "string" : "byte string");
+        return false;
+    }
 
-                fwrite(buf, written, 1, ctx->fdw);
-                fwrite(cbor_string_handle(i), cbor_string_length(i), 1, ctx->fdw);
-                ctx->bytes_written += written;
-                ctx->bytes_written += cbor_string_length(i);
-                log("==> set string value = %s\n", cbor_string_handle(i));
-            }
-            break;
-        };
-        case CBOR_TYPE_FLOAT_CTRL: {
-            if (cbor_float_ctrl_is_ctrl(i)) {
-                if (cbor_is_bool(i)) {
-                    unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-                    size_t written = cbor_encode_bool(cbor_get_bool(i), buf, sizeof(buf));
-                    if (!written) {
-                        ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-                        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for boolean");
-                        return;
-                    }
-
-                    fwrite(buf, written, 1, ctx->fdw);
-                    ctx->bytes_written += written;
-                    log("==> set boolean value = %s\n", cbor_get_bool(i) ? "true" : "false");
-                } else if (cbor_is_undef(i)) {
-                    unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-                    size_t written = cbor_encode_undef(buf, sizeof(buf));
-                    if (!written) {
-                        ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-                        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for undefined");
-                        return;
-                    }
-
-                    fwrite(buf, written, 1, ctx->fdw);
-                    ctx->bytes_written += written;
-                    log("==> set undefined value\n");
-                } else if (cbor_is_null(i)) {
-                    unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-                    size_t written = cbor_encode_null(buf, sizeof(buf));
-                    if (!written) {
-                        ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-                        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for null");
-                        return;
-                    }
-
-                    fwrite(buf, written, 1, ctx->fdw);
-                    ctx->bytes_written += written;
-                    log("==> set null value\n");
-                } else {
-                    unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-                    size_t written = cbor_encode_ctrl(cbor_ctrl_value(i), buf, sizeof(buf));
-                    if (!written) {
-                        ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-                        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for simple value");
-                        return;
-                    }
-
-                    fwrite(buf, written, 1, ctx->fdw);
-                    ctx->bytes_written += written;
-                    log("==> set simple value = %u\n", cbor_ctrl_value(i));
-                }
-            } else {
-                unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-                size_t written = 0;
-                switch (cbor_float_get_width(i)) {
-                    case CBOR_FLOAT_16:
-                        written = cbor_encode_half(cbor_float_get_float2(i), buf, sizeof(buf));
-                        break;
-                    case CBOR_FLOAT_32:
-                        written = cbor_encode_single(cbor_float_get_float4(i), buf, sizeof(buf));
-                        break;
-                    case CBOR_FLOAT_64:
-                        written = cbor_encode_double(cbor_float_get_float8(i), buf, sizeof(buf));
-                        break;
-                }
+    return write_output(ctx, buf, written);
+}
 
-                if (!written) {
-                    ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-                    snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for float (%dB)", _pow(2, cbor_float_get_width(i)));
-                    return;
-                }
+// Write the padding and the break that end a padded value, if pad isn't 0.
+static bool write_slot_tail(cft_context_t* ctx, uint8_t major, size_t pad) {
+    return pad == 0 || (fill_output(ctx, major << 5, pad) && fill_output(ctx, CBOR_BREAK, 1));
+}
 
-                fwrite(buf, written, 1, ctx->fdw);
-                ctx->bytes_written += written;
-                log("==> set float value = %lf (%dB)\n", cbor_float_get_float(i), _pow(2, cbor_float_get_width(i)));
-            }
-            break;
-        };
+// Write a string or byte string value followed by pad bytes of padding, or as a plain value if pad is 0.
+static void write_slot(cft_context_t* ctx, uint8_t major, cbor_data data, size_t length, size_t pad) {
+    if (write_slot_head(ctx, major, length, pad) && write_output(ctx, data, length)) {
+        write_slot_tail(ctx, major, pad);
     }
-
-    ctx->pointer_found = true;
 }
 
-void enc_string_callback(void* context, cbor_data data, size_t length) {
-    cft_context_t* ctx = context;
-    if (ctx->err != CFT_ERR_OK) {
-        return;
-    }
+// Size of the chunks a streamed value is read in
+#define STREAM_CHUNK_LEN 4096
 
-    container_context_t* cur_cc = get_top(ctx->stack, MAX_LEVEL, ctx->stack_top);
-    if (cur_cc == NULL) {
-        ctx->err = CFT_ERR_MALFORMATED_DATA;
-        snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "the value is not inside a map");
+// Write a byte string of length bytes read from the callback, chunk by chunk, padded if pad isn't 0.
+static void write_stream_slot(cft_context_t* ctx, size_t length, cft_read_cb_t read_cb, void* user, size_t pad) {
+    if (!write_slot_head(ctx, CBOR_MAJOR_BYTESTRING, length, pad)) {
         return;
     }
 
-    // If this string is a key
-
-    if (strlen(cur_cc->key) == 0) {
-        memset(cur_cc->key, 0, sizeof(cur_cc->key));
-        memcpy(cur_cc->key, data, length);
-
-        char tmp_pointer[MAX_POINTER_LEN] = {0};
-        strcpy(tmp_pointer, cur_cc->map_pointer);
-        strcat(tmp_pointer, cur_cc->key);
-
-        if (ctx->erase && (strcmp(ctx->pointer, tmp_pointer) == 0 || cur_cc->should_ignore)) {
+    uint8_t chunk[STREAM_CHUNK_LEN];
+    size_t left = length;
+    while (left > 0) {
+        size_t size = left < sizeof(chunk) ? left : sizeof(chunk);
+        size_t n = read_cb(user, chunk, size);
+        if (n == 0 || n > size) {
+            ctx->err = CFT_ERR_READ_STREAM_ERROR;
+            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "value stream ended after %" PRIu64 " of %" PRIu64 " bytes", length - left, length);
             return;
         }
 
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_string_start(length, buf, sizeof(buf));
-        if (written == 0) {
-            ctx->err = CFT_ERR_INSUFFICIENT_INIT_BYTES_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for data item initial bytes");
+        if (!write_output(ctx, chunk, n)) {
             return;
         }
-
-        fwrite(buf, written, 1, ctx->fdw);
-        fwrite(data, length, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        ctx->bytes_written += length;
-        return;
+        left -= n;
     }
 
-    // If this string is a value
-
-    // Check if we need to write a new value
-    char tmp_pointer[MAX_POINTER_LEN] = {0};
-    strcpy(tmp_pointer, cur_cc->map_pointer);
-    strcat(tmp_pointer, cur_cc->key);
+    write_slot_tail(ctx, CBOR_MAJOR_BYTESTRING, pad);
+}
 
-    // Because this is a value, we need to clear the key so that the next time we see a string, we will know it is a key.
-    memset(cur_cc->key, 0, sizeof(cur_cc->key));
+////////////////////////////////////////////////////////////////////////////////
 
-    bool should_ignore = cur_cc->should_ignore;
-    cur_cc->current_index++;
-    if (cur_cc->current_index >= cur_cc->size) {
-        // This is the last value in the map, so we're going to pop up the container context
-        pop(ctx->stack, MAX_LEVEL, &(ctx->stack_top));
+static void close_document(cft_context_t* h) {
+    // The index and the tree describe the open CBOR data, so they go away with it.
+    h->index.valid = false;
+    h->tree.valid = false;
 
-        // Get the parent container context of the current value
-        struct container_context* parent_cc = get_top(ctx->stack, MAX_LEVEL, ctx->stack_top);
-        if (parent_cc) {
-            memset(parent_cc->key, 0, sizeof(parent_cc->key));  // critical
-        }
+    if (h->map != NULL) {
+        munmap(h->map, h->content_len);
+        h->map = NULL;
     }
 
-    if (should_ignore) {
-        return;
+    if (h->fd != NULL) {
+        fclose(h->fd);
+        h->fd = NULL;
     }
+}
 
-    if (strcmp(ctx->pointer, tmp_pointer) != 0) {
-        // If the key is not specified by user, it means we need to write the existing value.
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_string_start(length, buf, sizeof(buf));
-        if (written == 0) {
-            ctx->err = CFT_ERR_INSUFFICIENT_INIT_BYTES_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for string initial bytes");
-            return;
-        }
+// Return true if st is not the same file as old, or the file has been modified in between.
+static bool stat_changed(const struct stat* st, const struct stat* old) {
+    return st->st_dev != old->st_dev || st->st_ino != old->st_ino || st->st_size != old->st_size ||
+           st->st_mtim.tv_sec != old->st_mtim.tv_sec || st->st_mtim.tv_nsec != old->st_mtim.tv_nsec;
+}
 
-        fwrite(buf, written, 1, ctx->fdw);
-        fwrite(data, length, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        ctx->bytes_written += length;
-        return;
+// Return true if the file at path is no longer the one described by old, or has been modified since.
+static bool file_changed(const char* path, const struct stat* old) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return true;
     }
 
-    // If we reach this point, it means we need to write the new value.
-    enc_value(ctx);
+    return stat_changed(&st, old);
 }
 
-void enc_uint8_callback(void* context, uint8_t value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
-    }
+// Return true if the file at h->path is no longer the one we have open, or has been modified since.
+static bool document_changed(cft_context_t* h) {
+    return file_changed(h->path, &h->content_stat);
+}
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_uint8(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for uint8");
-            return;
+// Make sure the CBOR data is open and up to date. The document stays open between calls,
+// and is only reloaded when the file has been replaced or modified.
+static bool open_document(cft_context_t* h) {
+    if (h->fd != NULL) {
+        if (!document_changed(h)) {
+            return true;
         }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
-    }
 
-    enc_value(ctx);
-}
+        log("\"%s\" has changed, reloading\n", h->path);
+        close_document(h);
+    }
 
-void enc_uint16_callback(void* context, uint16_t value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
+    h->fd = fopen(h->path, "rb");
+    if (h->fd == NULL) {
+        h->err = CFT_ERR_OPEN_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open path \"%s\"", h->path);
+        return false;
     }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_uint16(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for uint16");
-            return;
+    if (fstat(fileno(h->fd), &h->content_stat) != 0) {
+        fclose(h->fd);
+        h->fd = NULL;
+        h->err = CFT_ERR_OPEN_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to stat path \"%s\"", h->path);
+        return false;
+    }
+    h->content_len = (size_t)h->content_stat.st_size;
+    h->content_offset = 0;
+    h->content_avail = 0;
+
+    if (h->mode == CFT_MODE_MMAP && h->content_len > 0) {
+        void* p = mmap(NULL, h->content_len, PROT_READ, MAP_PRIVATE, fileno(h->fd), 0);
+        if (p == MAP_FAILED) {
+            fclose(h->fd);
+            h->fd = NULL;
+            h->err = CFT_ERR_MAP_FILE_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to map path \"%s\"", h->path);
+            return false;
         }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
+        h->map = p;
     }
 
-    enc_value(ctx);
+    return true;
 }
 
-void enc_uint32_callback(void* context, uint32_t value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
+// Return the CBOR data starting at offset, and the number of bytes available there.
+// In mmap mode this is a view of the whole remaining data, so no refill is ever needed.
+// In stream mode the buffer is only refilled when offset falls outside of what it holds.
+static cbor_data read_document(cft_context_t* h, size_t offset, size_t* len) {
+    if (offset >= h->content_len) {
+        *len = 0;
+        return h->content;
     }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_uint32(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for uint32");
-            return;
-        }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
+    if (h->map != NULL) {
+        *len = h->content_len - offset;
+        return h->map + offset;
+    }
+
+    if (offset < h->content_offset || offset >= h->content_offset + h->content_avail) {
+        fseek(h->fd, offset, SEEK_SET);
+        h->content_offset = offset;
+        h->content_avail = fread(h->content, 1, h->content_size, h->fd);
     }
 
-    enc_value(ctx);
+    *len = h->content_offset + h->content_avail - offset;
+    return h->content + (offset - h->content_offset);
 }
 
-void enc_uint64_callback(void* context, uint64_t value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
+// Grow the stream buffer to hold at least size bytes. Its content is dropped.
+static bool grow_document_buffer(cft_context_t* h, size_t size) {
+    size_t new_size = h->content_size * 2;
+    while (new_size < size) {
+        new_size *= 2;
     }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_uint64(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for uint64");
-            return;
-        }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
+    uint8_t* content = realloc(h->content, new_size);
+    if (content == NULL) {
+        h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to grow the content buffer to %" PRIu64 " bytes", new_size);
+        return false;
     }
 
-    enc_value(ctx);
+    h->content = content;
+    h->content_size = new_size;
+    h->content_avail = 0;
+    return true;
 }
 
-void enc_negint8_callback(void* context, uint8_t value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
+// Parse the initial bytes of the data item at the start of data.
+static bool parse_head(cbor_data data, size_t len, struct cbor_head* head) {
+    if (len == 0) {
+        return false;
     }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_negint8(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for negint8");
-            return;
-        }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
+    head->major = data[0] >> 5;
+    head->info = data[0] & 0x1f;
+    head->indefinite = false;
+    if (head->info < 24) {
+        head->value = head->info;
+        head->len = 1;
+        return true;
     }
 
-    enc_value(ctx);
-}
-
-void enc_negint16_callback(void* context, uint16_t value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
+    if (head->info == 31 && (head->major == CBOR_MAJOR_BYTESTRING || head->major == CBOR_MAJOR_STRING)) {
+        // A padded value, its length is only known once its chunks have been parsed
+        head->indefinite = true;
+        head->value = 0;
+        head->len = 1;
+        return true;
     }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_negint16(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for negint16");
-            return;
-        }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
+    if (head->info > 27) {
+        // Other indefinite length items (and reserved values) are not supported
+        return false;
     }
 
-    enc_value(ctx);
-}
-
-void enc_negint32_callback(void* context, uint32_t value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
+    head->len = 1 + _pow(2, head->info - 24);
+    if (len < head->len) {
+        return false;
     }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_negint32(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for negint32");
-            return;
-        }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
+    head->value = 0;
+    for (size_t i = 1; i < head->len; i++) {
+        head->value = (head->value << 8) | data[i];
     }
 
-    enc_value(ctx);
+    return true;
 }
 
-void enc_negint64_callback(void* context, uint64_t value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
-    }
-
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_negint64(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for negint64");
-            return;
-        }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
+// Read the initial bytes of the data item at offset.
+static bool read_head(cft_context_t* h, size_t offset, struct cbor_head* head) {
+    size_t len = 0;
+    cbor_data data = read_document(h, offset, &len);
+    if (len <= MAX_INIT_BYTES_LEN && h->map == NULL && offset + len < h->content_len) {
+        // The initial bytes straddle the end of the buffer, refill it starting at the item.
+        h->content_avail = 0;
+        data = read_document(h, offset, &len);
     }
 
-    enc_value(ctx);
+    return parse_head(data, len, head);
 }
 
-void enc_byte_string_callback(void* context, cbor_data data, size_t length) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
+// Parse the padded value at the start of data. Only a single chunk may hold the value,
+// the chunks after it must be empty.
+static enum cbor_decoder_status parse_slot(cbor_data data, size_t len, struct cbor_slot* slot) {
+    struct cbor_head head;
+    if (!parse_head(data, len, &head) || !head.indefinite) {
+        return CBOR_DECODER_ERROR;
     }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_bytestring_start(length, buf, sizeof(buf));
-        if (written == 0) {
-            ctx->err = CFT_ERR_INSUFFICIENT_INIT_BYTES_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for byte string initial bytes");
-            return;
+    slot->major = head.major;
+    slot->head_len = head.len;
+    slot->length = 0;
+    slot->pad = 0;
+
+    size_t pos = head.len;
+    if (pos < len && data[pos] != CBOR_BREAK) {
+        if (!parse_head(data + pos, len - pos, &head)) {
+            return len - pos <= MAX_INIT_BYTES_LEN ? CBOR_DECODER_NEDATA : CBOR_DECODER_ERROR;
         }
 
-        fwrite(buf, written, 1, ctx->fdw);
-        fwrite(data, length, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        ctx->bytes_written += length;
-        return;
+        if (head.major != slot->major || head.indefinite) {
+            return CBOR_DECODER_ERROR;
+        }
+
+        slot->head_len += head.len;
+        slot->length = head.value;
+        pos = slot->head_len + slot->length;
     }
 
-    enc_value(ctx);
-}
+    while (pos < len && data[pos] == slot->major << 5) {
+        slot->pad++;
+        pos++;
+    }
 
-void enc_float2_callback(void* context, float value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
+    if (pos >= len) {
+        return CBOR_DECODER_NEDATA;
     }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_half(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for float2");
-            return;
-        }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
+    if (data[pos] != CBOR_BREAK) {
+        // The value is split over several chunks
+        return CBOR_DECODER_ERROR;
     }
 
-    enc_value(ctx);
+    slot->len = pos + 1;
+    return CBOR_DECODER_FINISHED;
 }
 
-void enc_float4_callback(void* context, float value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
-    }
+// Parse the padded value at offset. In stream mode the whole value ends up in the buffer.
+static bool read_slot(cft_context_t* h, size_t offset, struct cbor_slot* slot) {
+    while (true) {
+        size_t len = 0;
+        cbor_data data = read_document(h, offset, &len);
+        enum cbor_decoder_status status = parse_slot(data, len, slot);
+        if (status != CBOR_DECODER_NEDATA || h->map != NULL || offset + len >= h->content_len) {
+            return status == CBOR_DECODER_FINISHED;
+        }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_single(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for float4");
-            return;
+        // The value straddles the end of the buffer, refill it starting at the value.
+        if (h->content_offset == offset && !grow_document_buffer(h, h->content_size * 2)) {
+            return false;
         }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
+        h->content_avail = 0;
     }
-
-    enc_value(ctx);
 }
 
-void enc_float8_callback(void* context, double value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
-    }
-
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_double(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for float8");
-            return;
+// Move offset past count data items (and all their content), reading nothing but their initial bytes.
+static bool skip_items(cft_context_t* h, size_t* offset, size_t count) {
+    size_t pos = *offset;
+    while (count > 0) {
+        struct cbor_head head;
+        if (!read_head(h, pos, &head)) {
+            return false;
         }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
-    }
 
-    enc_value(ctx);
-}
+        if (head.indefinite) {
+            struct cbor_slot slot;
+            if (!read_slot(h, pos, &slot)) {
+                return false;
+            }
+            head.len = slot.len;
+        }
 
-void enc_null_callback(void* context) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
-    }
+        pos += head.len;
+        count--;
+        switch (head.major) {
+            case CBOR_MAJOR_BYTESTRING:
+            case CBOR_MAJOR_STRING:
+                pos += head.value;
+                break;
+            case CBOR_MAJOR_ARRAY:
+            case CBOR_MAJOR_TAG:
+                count += head.major == CBOR_MAJOR_ARRAY ? head.value : 1;
+                break;
+            case CBOR_MAJOR_MAP:
+                count += 2 * head.value;
+                break;
+        }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_null(buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for null");
-            return;
+        if (pos > h->content_len) {
+            return false;
         }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
     }
 
-    enc_value(ctx);
+    *offset = pos;
+    return true;
 }
 
-void enc_undefined_callback(void* context) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
+// Decode the data item at the start of data. Padded values are handed to the callbacks as plain values.
+static struct cbor_decoder_result decode_item(cft_context_t* h, cbor_data data, size_t len, const struct cbor_callbacks* callbacks) {
+    struct cbor_head head;
+    if (!parse_head(data, len, &head) || !head.indefinite) {
+        return cbor_stream_decode(data, len, callbacks, h);
     }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_undef(buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for undefined");
-            return;
-        }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
+    struct cbor_decoder_result result = {0};
+    struct cbor_slot slot;
+    result.status = parse_slot(data, len, &slot);
+    if (result.status != CBOR_DECODER_FINISHED) {
+        return result;
+    }
+
+    if (slot.major == CBOR_MAJOR_STRING) {
+        callbacks->string(h, data + slot.head_len, slot.length);
+    } else {
+        callbacks->byte_string(h, data + slot.head_len, slot.length);
     }
 
-    enc_value(ctx);
+    result.read = slot.len;
+    return result;
 }
 
-void enc_boolean_callback(void* context, bool value) {
-    cft_context_t* ctx = context;
-    bool write_new_value;
-    if (!enc_prepare_context_for_value(ctx, &write_new_value)) {
-        return;
-    }
+// Feed the whole CBOR data to the decoder, one item per cbor_stream_decode call.
+// Stops early when the given predicate says the current operation is done.
+static void decode_document(cft_context_t* h, const struct cbor_callbacks* callbacks, bool (*done)(cft_context_t* h)) {
+    size_t bytes_read = 0;
+    while (bytes_read < h->content_len) {
+        size_t len = 0;
+        cbor_data data = read_document(h, bytes_read, &len);
+        struct cbor_decoder_result decode_result = decode_item(h, data, len, callbacks);
+        if (decode_result.status == CBOR_DECODER_NEDATA && h->map == NULL && bytes_read + len < h->content_len) {
+            // The item straddles the end of the buffer, refill it starting at the item.
+            // If the buffer already starts at the item, the item is larger than the whole buffer.
+            if (h->content_offset == bytes_read && !grow_document_buffer(h, h->content_size * 2)) {
+                break;
+            }
+            h->content_avail = 0;
+            continue;
+        }
 
-    if (!write_new_value) {
-        unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
-        size_t written = cbor_encode_bool(value, buf, sizeof(buf));
-        if (!written) {
-            ctx->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for boolean");
-            return;
+        if (decode_result.status != CBOR_DECODER_FINISHED) {
+            if (h->err == CFT_ERR_OK) {
+                h->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to decode data item at offset %" PRIu64, bytes_read);
+            }
+            break;
         }
-        fwrite(buf, written, 1, ctx->fdw);
-        ctx->bytes_written += written;
-        return;
-    }
 
-    enc_value(ctx);
-}
+        if (h->pointer_found) {
+            h->value_offset = bytes_read;
+            h->value_length = decode_result.read;
+        }
 
-void enc_array_start_callback(void* context, size_t size) {
-    cft_context_t* ctx = context;
-    if (ctx->err != CFT_ERR_OK) {
-        return;
-    }
+        if (done(h)) {
+            break;
+        }
 
-    ctx->err = CFT_ERR_CBOR_TYPE_NOT_ALLOWED;
-    snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "array is not supported");
-    return;
-}
+        bytes_read += decode_result.read;
 
-void enc_tag_callback(void* context, uint64_t value) {
-    cft_context_t* ctx = context;
-    if (ctx->err != CFT_ERR_OK) {
-        return;
+        if (h->skip_value) {
+            h->skip_value = false;
+            if (!skip_items(h, &bytes_read, h->skip_count)) {
+                h->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, bytes_read);
+                break;
+            }
+
+            finish_value(h);
+            if (done(h)) {
+                break;
+            }
+        }
     }
+}
 
-    ctx->err = CFT_ERR_CBOR_TYPE_NOT_ALLOWED;
-    snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "optional tag is not supported");
-    return;
+static bool get_done(cft_context_t* h) {
+    return h->pointer_found || h->err != CFT_ERR_OK || strlen(h->insertion_map_pointer) > strlen(ROOT_MAP_POINTER);
 }
 
-void enc_byte_string_start_callback(void* context) {
-    cft_context_t* ctx = context;
-    if (ctx->err != CFT_ERR_OK) {
-        return;
+#define HASH_POINTER_SEED 2166136261u
+
+// Continue hashing a JSON Pointer with len more bytes
+static uint32_t hash_pointer_update(uint32_t hash, const char* pointer, size_t len) {
+    // 32-bit FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)pointer[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    ctx->err = CFT_ERR_CBOR_TYPE_NOT_ALLOWED;
-    snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "indefinite byte string is not supported");
-    return;
+static uint32_t hash_pointer(const char* pointer, size_t len) {
+    return hash_pointer_update(HASH_POINTER_SEED, pointer, len);
 }
 
-void enc_string_start_callback(void* context) {
-    cft_context_t* ctx = context;
-    if (ctx->err != CFT_ERR_OK) {
-        return;
+static void free_index(cft_index_t* idx) {
+    if (idx->file_map != NULL) {
+        munmap(idx->file_map, idx->file_map_len);
+        idx->file_map = NULL;
+        idx->file_map_len = 0;
+    } else {
+        free(idx->entries);
+        free(idx->slots);
+        free(idx->names);
     }
-
-    ctx->err = CFT_ERR_CBOR_TYPE_NOT_ALLOWED;
-    snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "indefinite string is not supported");
-    return;
+    idx->entries = NULL;
+    idx->slots = NULL;
+    idx->names = NULL;
+    idx->count = 0;
+    idx->capacity = 0;
+    idx->slot_count = 0;
+    idx->names_len = 0;
+    idx->names_size = 0;
+    idx->valid = false;
 }
 
-void enc_indef_array_start_callback(void* context) {
-    cft_context_t* ctx = context;
-    if (ctx->err != CFT_ERR_OK) {
-        return;
+// Copy len bytes of the CBOR data starting at offset, whatever the read mode is.
+static bool read_bytes(cft_context_t* h, size_t offset, void* buf, size_t len) {
+    uint8_t* out = buf;
+    while (len > 0) {
+        size_t avail = 0;
+        cbor_data data = read_document(h, offset, &avail);
+        if (avail == 0) {
+            return false;
+        }
+
+        size_t n = avail < len ? avail : len;
+        memcpy(out, data, n);
+        out += n;
+        offset += n;
+        len -= n;
     }
 
-    ctx->err = CFT_ERR_CBOR_TYPE_NOT_ALLOWED;
-    snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "indefinite array is not supported");
-    return;
+    return true;
 }
 
-void enc_indef_map_start_callback(void* context) {
-    cft_context_t* ctx = context;
-    if (ctx->err != CFT_ERR_OK) {
-        return;
+static bool add_index_entry(cft_context_t* h, const char* pointer, size_t pointer_len, uint32_t major, size_t offset) {
+    cft_index_t* idx = &h->index;
+    if (idx->count == idx->capacity) {
+        size_t capacity = idx->capacity ? idx->capacity * 2 : 64;
+        cft_index_entry_t* entries = realloc(idx->entries, capacity * sizeof(cft_index_entry_t));
+        if (entries == NULL) {
+            h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate index entries");
+            return false;
+        }
+        idx->entries = entries;
+        idx->capacity = capacity;
     }
 
-    ctx->err = CFT_ERR_CBOR_TYPE_NOT_ALLOWED;
-    snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "indefinite map is not supported");
-    return;
-}
-
-void enc_indef_break_callback(void* context) {
-    cft_context_t* ctx = context;
-    if (ctx->err != CFT_ERR_OK) {
-        return;
+    if (idx->names_len + pointer_len > idx->names_size) {
+        size_t size = idx->names_size ? idx->names_size * 2 : 4096;
+        while (idx->names_len + pointer_len > size) {
+            size *= 2;
+        }
+        char* names = realloc(idx->names, size);
+        if (names == NULL) {
+            h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate index name pool");
+            return false;
+        }
+        idx->names = names;
+        idx->names_size = size;
     }
 
-    ctx->err = CFT_ERR_CBOR_TYPE_NOT_ALLOWED;
-    snprintf(ctx->err_msg, MAX_ERR_MSG_LEN, "indefinite break is not supported");
-    return;
+    cft_index_entry_t* e = &idx->entries[idx->count++];
+    e->hash = hash_pointer(pointer, pointer_len);
+    e->pointer_off = idx->names_len;
+    e->pointer_len = pointer_len;
+    e->major = major;
+    e->offset = offset;
+    e->length = 0;
+    memcpy(idx->names + idx->names_len, pointer, pointer_len);
+    idx->names_len += pointer_len;
+    return true;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-static cbor_item_t* get_item(cft_context_t* h, const char* pointer) {
-    memset(h->pointer, 0, sizeof(h->pointer));
-    strncpy(h->pointer, pointer, strlen(pointer));
-    h->stack_top = -1;
-    h->pointer_found = false;
-    h->insert = false;
-    h->set = false;
-    h->erase = false;
-    h->err = CFT_ERR_OK;
-    h->bytes_written = 0;
+// Add an entry for every key of the map whose content starts at *offset, and move *offset past the map.
+// path holds the JSON Pointer of the map (without the trailing '/').
+static bool index_map(cft_context_t* h, size_t* offset, uint64_t size, char* path, size_t path_len) {
+    for (uint64_t i = 0; i < size; i++) {
+        struct cbor_head head;
+        if (!read_head(h, *offset, &head) || head.major != CBOR_MAJOR_STRING || head.indefinite) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is not a string", *offset);
+            return false;
+        }
 
-    h->fd = fopen(h->path, "rb");
-    if (h->fd == NULL) {
-        h->err = CFT_ERR_OPEN_FILE_ERROR;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open path \"%s\"", h->path);
-        return NULL;
-    }
+        size_t key_len = head.value;
+        if (path_len + 1 + key_len > MAX_POINTER_LEN) {
+            h->err = CFT_ERR_INSUFFICIENT_BUFFER;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for the pointer of key at offset %" PRIu64, *offset);
+            return false;
+        }
 
-    fseek(h->fd, 0, SEEK_SET);
-    fread(h->content, h->content_size, 1, h->fd);
+        path[path_len] = '/';
+        if (!read_bytes(h, *offset + head.len, path + path_len + 1, key_len)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is truncated", *offset);
+            return false;
+        }
+        *offset += head.len + key_len;
 
-    size_t bytes_read = 0;
-    struct cbor_decoder_result decode_result;
-    while (bytes_read < h->content_len) {
-        decode_result = cbor_stream_decode(h->content, h->content_size, &(h->dec_callbacks), h);
-        if (h->pointer_found || h->err != CFT_ERR_OK || strlen(h->insertion_map_pointer) > strlen(ROOT_MAP_POINTER)) {
-            break;
+        size_t value_offset = *offset;
+        if (!read_head(h, value_offset, &head)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to decode data item at offset %" PRIu64, value_offset);
+            return false;
         }
 
-        bytes_read += decode_result.read;
-        fseek(h->fd, bytes_read, SEEK_SET);
-        fread(h->content, h->content_size, 1, h->fd);
-    }
+        size_t entry = h->index.count;
+        if (!add_index_entry(h, path, path_len + 1 + key_len, head.major, value_offset)) {
+            return false;
+        }
 
-    fclose(h->fd);
-    h->fd = NULL;
+        if (head.major == CBOR_MAJOR_MAP) {
+            *offset += head.len;
+            if (!index_map(h, offset, head.value, path, path_len + 1 + key_len)) {
+                return false;
+            }
+        } else if (!skip_items(h, offset, 1)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, value_offset);
+            return false;
+        }
 
-    if (h->err != CFT_ERR_OK) {
-        return NULL;
+        h->index.entries[entry].length = *offset - value_offset;
     }
 
-    if (!h->pointer_found) {
-        h->err = CFT_ERR_POINTER_NOT_FOUND;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist, but \"%s\" exists\n", h->pointer, h->insertion_map_pointer);
-        return NULL;
+    return true;
+}
+
+static cft_index_entry_t* find_index_entry(cft_index_t* idx, const char* pointer, size_t len, uint32_t hash) {
+    size_t mask = idx->slot_count - 1;
+    for (size_t i = hash & mask; idx->slots[i] != 0; i = (i + 1) & mask) {
+        cft_index_entry_t* e = &idx->entries[idx->slots[i] - 1];
+        if (e->hash == hash && e->pointer_len == len && memcmp(idx->names + e->pointer_off, pointer, len) == 0) {
+            return e;
+        }
     }
 
-    return &h->item;
+    return NULL;
 }
 
-static cft_err_t set_item(cft_context_t* h, const char* pointer) {
-    memset(h->pointer, 0, sizeof(h->pointer));
-    strncpy(h->pointer, pointer, strlen(pointer));
-    h->stack_top = -1;
-    h->pointer_found = false;
-    h->insert = false;
-    h->set = true;
-    h->erase = false;
-    h->err = CFT_ERR_OK;
-    h->bytes_written = 0;
+// Scan the whole CBOR data once, and record the offset of every value by its JSON Pointer.
+static bool build_index(cft_context_t* h) {
+    cft_index_t* idx = &h->index;
+    free_index(idx);
+
+    struct cbor_head head;
+    size_t offset = 0;
+    char path[MAX_POINTER_LEN + 1] = {0};
+    if (!read_head(h, offset, &head) || head.major != CBOR_MAJOR_MAP) {
+        h->err = CFT_ERR_MALFORMATED_DATA;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "the root data item is not a map");
+        return false;
+    }
 
-    // First we need to prepare a temp file for storing the new CBOR data
-    char* tmp_name = tempnam(NULL, NULL);
-    h->fdw = fopen(tmp_name, "wb");
-    if (h->fdw == NULL) {
-        h->err = CFT_ERR_CREATE_TEMP_FILE_ERROR;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open temp file \"%s\"", tmp_name);
-        free(tmp_name);
-        return h->err;
+    offset += head.len;
+    if (!index_map(h, &offset, head.value, path, 0)) {
+        free_index(idx);
+        return false;
     }
 
-    h->fd = fopen(h->path, "rb");
-    if (h->fd == NULL) {
-        fclose(h->fdw);
-        h->fdw = NULL;
-        remove(tmp_name);
-        free(tmp_name);
-        h->err = CFT_ERR_OPEN_FILE_ERROR;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open path \"%s\"", h->path);
-        return h->err;
+    idx->slot_count = 16;
+    while (idx->slot_count < idx->count * 2) {
+        idx->slot_count *= 2;
     }
 
-    fseek(h->fd, 0, SEEK_SET);
-    fread(h->content, h->content_size, 1, h->fd);
+    idx->slots = calloc(idx->slot_count, sizeof(uint32_t));
+    if (idx->slots == NULL) {
+        free_index(idx);
+        h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate index slots");
+        return false;
+    }
 
-    size_t bytes_read = 0;
-    struct cbor_decoder_result decode_result;
-    while (bytes_read < h->content_len) {
-        decode_result = cbor_stream_decode(h->content, h->content_size, &(h->enc_callbacks), h);
-        if (h->err != CFT_ERR_OK) {
-            break;
+    size_t mask = idx->slot_count - 1;
+    for (size_t n = 0; n < idx->count; n++) {
+        cft_index_entry_t* e = &idx->entries[n];
+        // If a key appears twice in a map, keep the first one, like a scan does.
+        if (find_index_entry(idx, idx->names + e->pointer_off, e->pointer_len, e->hash) != NULL) {
+            continue;
         }
 
-        bytes_read += decode_result.read;
-        fseek(h->fd, bytes_read, SEEK_SET);
-        fread(h->content, h->content_size, 1, h->fd);
+        size_t i = e->hash & mask;
+        while (idx->slots[i] != 0) {
+            i = (i + 1) & mask;
+        }
+        idx->slots[i] = n + 1;
     }
 
-    fclose(h->fd);
-    h->fd = NULL;
+    idx->valid = true;
+    log("==> index built, %" PRIu64 " entries\n", idx->count);
+    return true;
+}
 
-    fclose(h->fdw);
-    h->fdw = NULL;
+// The index file holds this header, then the entries, the slots and the name pool of the index,
+// exactly as they are laid out in memory. It is only meant to be read back on the same machine.
+struct index_file_header {
+    char magic[8];
+    uint64_t data_size;        ///< Size of the CBOR data the index was built from
+    int64_t data_mtime_sec;    ///< Modification time of the CBOR data the index was built from
+    int64_t data_mtime_nsec;
+    uint64_t data_hash;        ///< Hash of the CBOR data the index was built from
+    uint64_t count;
+    uint64_t slot_count;
+    uint64_t names_len;
+};
+
+#define INDEX_FILE_MAGIC "CFTIDX1"
+
+static void get_index_path(cft_context_t* h, char* path, size_t size) {
+    snprintf(path, size, "%s%s", h->path, INDEX_FILE_SUFFIX);
+}
 
-    // Delete the original file and rename the temp file
-    remove(h->path);
-    rename(tmp_name, h->path);
-    free(tmp_name);
+static bool hash_document(cft_context_t* h, uint64_t* hash) {
+    // 64-bit FNV-1a
+    *hash = 14695981039346656037u;
+    size_t offset = 0;
+    while (offset < h->content_len) {
+        size_t len = 0;
+        cbor_data data = read_document(h, offset, &len);
+        if (len == 0) {
+            return false;
+        }
 
-    if (!h->pointer_found) {
-        h->err = CFT_ERR_POINTER_NOT_FOUND;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist\n", h->pointer);
-        return h->err;
+        for (size_t i = 0; i < len; i++) {
+            *hash ^= data[i];
+            *hash *= 1099511628211u;
+        }
+        offset += len;
     }
 
-    return h->err;
+    return true;
 }
 
-static cft_err_t insert_item(cft_context_t* h, const char* pointer) {
-    memset(h->pointer, 0, sizeof(h->pointer));
-    strncpy(h->pointer, pointer, strlen(pointer));
-    h->stack_top = -1;
-    h->pointer_found = false;
-    h->insert = false;
-    h->set = false;
-    h->erase = false;
-    h->err = CFT_ERR_OK;
-    h->bytes_written = 0;
+// Map the index file, and use it if it was built from the open CBOR data.
+static bool map_index_file(cft_context_t* h) {
+    char path[MAX_PATH_LEN + sizeof(INDEX_FILE_SUFFIX)];
+    get_index_path(h, path, sizeof(path));
 
-    h->fd = fopen(h->path, "rb");
-    if (h->fd == NULL) {
-        h->err = CFT_ERR_OPEN_FILE_ERROR;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open path \"%s\"", h->path);
-        return h->err;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
     }
 
-    fseek(h->fd, 0, SEEK_SET);
-    fread(h->content, h->content_size, 1, h->fd);
+    struct stat st;
+    void* p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct index_file_header)) {
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+
+    const struct index_file_header* header = p;
+    uint64_t hash = 0;
+    bool valid = memcmp(header->magic, INDEX_FILE_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->slot_count > 0 && (header->slot_count & (header->slot_count - 1)) == 0 &&
+                 (size_t)st.st_size == sizeof(*header) + header->count * sizeof(cft_index_entry_t) +
+                                          header->slot_count * sizeof(uint32_t) + header->names_len &&
+                 header->data_size == h->content_len && header->data_mtime_sec == h->content_stat.st_mtim.tv_sec &&
+                 header->data_mtime_nsec == h->content_stat.st_mtim.tv_nsec && hash_document(h, &hash) &&
+                 header->data_hash == hash;
+    if (!valid) {
+        log("==> index file \"%s\" is stale\n", path);
+        munmap(p, st.st_size);
+        return false;
+    }
+
+    cft_index_t* idx = &h->index;
+    idx->file_map = p;
+    idx->file_map_len = st.st_size;
+    idx->entries = (cft_index_entry_t*)(header + 1);
+    idx->count = header->count;
+    idx->capacity = header->count;
+    idx->slots = (uint32_t*)(idx->entries + idx->count);
+    idx->slot_count = header->slot_count;
+    idx->names = (char*)(idx->slots + idx->slot_count);
+    idx->names_len = header->names_len;
+    idx->names_size = header->names_len;
+    idx->valid = true;
+    log("==> index file \"%s\" loaded, %" PRIu64 " entries\n", path, idx->count);
+    return true;
+}
+
+static bool write_index_file(cft_context_t* h) {
+    cft_index_t* idx = &h->index;
+    char path[MAX_PATH_LEN + sizeof(INDEX_FILE_SUFFIX)];
+    char tmp_path[MAX_PATH_LEN + sizeof(INDEX_FILE_SUFFIX) + 4];
+    get_index_path(h, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    struct index_file_header header = {0};
+    memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+    header.data_size = h->content_len;
+    header.data_mtime_sec = h->content_stat.st_mtim.tv_sec;
+    header.data_mtime_nsec = h->content_stat.st_mtim.tv_nsec;
+    header.count = idx->count;
+    header.slot_count = idx->slot_count;
+    header.names_len = idx->names_len;
+    if (!hash_document(h, &header.data_hash)) {
+        return false;
+    }
+
+    FILE* f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        log("==> fail to open index file \"%s\"\n", tmp_path);
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(idx->entries, sizeof(cft_index_entry_t), idx->count, f) == idx->count &&
+              fwrite(idx->slots, sizeof(uint32_t), idx->slot_count, f) == idx->slot_count &&
+              fwrite(idx->names, 1, idx->names_len, f) == idx->names_len;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        log("==> fail to write index file \"%s\"\n", path);
+        remove(tmp_path);
+        return false;
+    }
+
+    return true;
+}
+
+// Make the index match the open CBOR data: use the index file if it is up to date,
+// otherwise scan the data, and persist the result if an index file is wanted.
+static bool load_index(cft_context_t* h) {
+    free_index(&h->index);
+    if (h->index.use_file && map_index_file(h)) {
+        return true;
+    }
+
+    if (!build_index(h)) {
+        return false;
+    }
+
+    if (h->index.use_file) {
+        write_index_file(h);
+    }
+
+    return true;
+}
+
+// Bring the index file up to date after the CBOR data has been rewritten.
+static void update_index_file(cft_context_t* h) {
+    if (!h->index.enabled || !h->index.use_file || h->err != CFT_ERR_OK) {
+        return;
+    }
+
+    if (!open_document(h) || !load_index(h)) {
+        // The rewrite itself succeeded. The stale index file will be rebuilt by the next lookup.
+        log("==> fail to update index file: %s\n", h->err_msg);
+        h->err = CFT_ERR_OK;
+    }
+}
+
+// How the value of a tree node is stored. The scalars the dec_* callbacks handle are kept inline,
+// everything else is kept encoded in the data of the tree.
+enum tree_type {
+    TREE_ENCODED,
+    TREE_MAP,
+    TREE_UINT8,
+    TREE_UINT16,
+    TREE_UINT32,
+    TREE_UINT64,
+    TREE_NEGINT8,
+    TREE_NEGINT16,
+    TREE_NEGINT32,
+    TREE_NEGINT64,
+    TREE_FLOAT2,
+    TREE_FLOAT4,
+    TREE_FLOAT8,
+    TREE_BOOL,
+    TREE_NULL,
+};
+
+// Maps with more children than this are binary searched down to a run of this many hashes, which is then scanned.
+#define TREE_SCAN_LEN 8
+
+// A node while the tree is built. The nodes are split into the arrays of the tree once the children are sorted.
+struct tree_node {
+    uint32_t key_hash;
+    uint32_t key_off;
+    uint32_t key_len;
+    uint32_t count;
+    uint8_t type;
+    uint64_t value;
+};
+
+static void free_tree(cft_tree_t* t) {
+    free(t->arena);
+    t->arena = NULL;
+    t->node_count = 0;
+    t->value = NULL;
+    t->key_hash = NULL;
+    t->key_off = NULL;
+    t->key_len = NULL;
+    t->count = NULL;
+    t->type = NULL;
+    t->data = NULL;
+    t->data_len = 0;
+    t->valid = false;
+}
+
+// Children sort by key hash. Among equal hashes the first key in the CBOR data comes first.
+static int compare_tree_nodes(const void* a, const void* b) {
+    const struct tree_node* na = a;
+    const struct tree_node* nb = b;
+    if (na->key_hash != nb->key_hash) {
+        return na->key_hash < nb->key_hash ? -1 : 1;
+    }
+
+    return na->key_off < nb->key_off ? -1 : na->key_off > nb->key_off;
+}
+
+// Widen a half precision float to single precision, as the decoder does before calling the float2 callback.
+static uint32_t half_to_float_bits(uint16_t half) {
+    uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+    uint32_t exp = (half >> 10) & 0x1f;
+    uint32_t mant = half & 0x3ff;
+    if (exp == 31) {
+        return sign | 0x7f800000 | (mant << 13);
+    }
+
+    if (exp != 0) {
+        return sign | ((exp + 112) << 23) | (mant << 13);
+    }
+
+    // Subnormal, which single precision represents exactly
+    float f = mant / 16777216.0f;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return sign | bits;
+}
+
+// Keep the scalar with the given initial bytes inline in node. Return false if the value isn't such a scalar.
+static bool tree_scalar(const struct cbor_head* head, struct tree_node* node) {
+    // One byte for the values held by the initial byte itself, then 1, 2, 4 or 8 bytes
+    size_t width = head->info < 24 ? 0 : head->info - 24;
+    switch (head->major) {
+        case CBOR_MAJOR_UINT:
+            node->type = TREE_UINT8 + width;
+            node->value = head->value;
+            return true;
+        case CBOR_MAJOR_NEGINT:
+            node->type = TREE_NEGINT8 + width;
+            node->value = head->value;
+            return true;
+        case CBOR_MAJOR_SIMPLE:
+            break;
+        default:
+            return false;
+    }
+
+    switch (head->info) {
+        case 20:
+        case 21:
+            node->type = TREE_BOOL;
+            node->value = head->info == 21;
+            return true;
+        case 22:
+            node->type = TREE_NULL;
+            return true;
+        case 25:
+            node->type = TREE_FLOAT2;
+            node->value = half_to_float_bits(head->value);
+            return true;
+        case 26:
+            node->type = TREE_FLOAT4;
+            node->value = head->value;
+            return true;
+        case 27:
+            node->type = TREE_FLOAT8;
+            node->value = head->value;
+            return true;
+    }
+
+    return false;
+}
+
+// Fill the nodes [first, first + size) with the keys of the map whose content starts at *offset, and move *offset
+// past the map. The children of the nested maps get their own range at the end of the nodes. Until nodes is
+// allocated, only the nodes and the data they need are counted.
+static bool tree_map(cft_context_t* h, cft_tree_t* t, struct tree_node* nodes, size_t* offset, uint64_t size, size_t first) {
+    for (uint64_t i = 0; i < size; i++) {
+        struct tree_node* node = nodes != NULL ? &nodes[first + i] : NULL;
+        struct cbor_head head;
+        if (!read_head(h, *offset, &head) || head.major != CBOR_MAJOR_STRING || head.indefinite) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is not a string", *offset);
+            return false;
+        }
+
+        size_t key_len = head.value;
+        if (node != NULL) {
+            if (!read_bytes(h, *offset + head.len, t->data + t->data_len, key_len)) {
+                h->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is truncated", *offset);
+                return false;
+            }
+            node->key_hash = hash_pointer((const char*)t->data + t->data_len, key_len);
+            node->key_off = t->data_len;
+            node->key_len = key_len;
+        }
+        t->data_len += key_len;
+        *offset += head.len + key_len;
+
+        size_t value_offset = *offset;
+        if (!read_head(h, value_offset, &head)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to decode data item at offset %" PRIu64, value_offset);
+            return false;
+        }
+
+        struct tree_node scalar;
+        if (head.major == CBOR_MAJOR_MAP) {
+            size_t child = t->node_count;
+            t->node_count += head.value;
+            *offset += head.len;
+            if (node != NULL) {
+                node->type = TREE_MAP;
+                node->value = child;
+                node->count = head.value;
+            }
+
+            if (!tree_map(h, t, nodes, offset, head.value, child)) {
+                return false;
+            }
+        } else if (!skip_items(h, offset, 1)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, value_offset);
+            return false;
+        } else if (tree_scalar(&head, node != NULL ? node : &scalar)) {
+            // Nothing left to keep
+        } else {
+            size_t len = *offset - value_offset;
+            if (node != NULL) {
+                node->type = TREE_ENCODED;
+                node->value = t->data_len;
+                node->count = len;
+                read_bytes(h, value_offset, t->data + t->data_len, len);
+            }
+            t->data_len += len;
+        }
+
+        if (t->node_count > UINT32_MAX || t->data_len > UINT32_MAX) {
+            h->err = CFT_ERR_INSUFFICIENT_BUFFER;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "CBOR data is too large for the in-memory tree");
+            return false;
+        }
+    }
+
+    if (nodes != NULL) {
+        qsort(nodes + first, size, sizeof(struct tree_node), compare_tree_nodes);
+    }
+
+    return true;
+}
+
+// Build the in-memory tree of the open CBOR data. A first pass sizes the arena, a second one fills the nodes
+// and the data, and the nodes are then split into the arrays of the tree.
+static bool build_tree(cft_context_t* h) {
+    cft_tree_t* t = &h->tree;
+    free_tree(t);
+
+    struct cbor_head root;
+    if (!read_head(h, 0, &root) || root.major != CBOR_MAJOR_MAP) {
+        h->err = CFT_ERR_MALFORMATED_DATA;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "the root data item is not a map");
+        return false;
+    }
+
+    struct tree_node* nodes = NULL;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t offset = root.len;
+        t->node_count = 1 + root.value;
+        t->data_len = 0;
+        if (!tree_map(h, t, nodes, &offset, root.value, 1)) {
+            free(nodes);
+            free_tree(t);
+            return false;
+        }
+
+        if (pass == 0) {
+            size_t n = t->node_count;
+            size_t arrays_size = n * (sizeof(uint64_t) + 4 * sizeof(uint32_t) + sizeof(uint8_t));
+            nodes = calloc(n, sizeof(struct tree_node));
+            t->arena = malloc(arrays_size + t->data_len);
+            if (nodes == NULL || t->arena == NULL) {
+                free(nodes);
+                free_tree(t);
+                h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate the in-memory tree (%" PRIu64 " bytes)", arrays_size + t->data_len);
+                return false;
+            }
+
+            // The widest arrays first keep every array aligned
+            t->value = t->arena;
+            t->key_hash = (uint32_t*)(t->value + n);
+            t->key_off = t->key_hash + n;
+            t->key_len = t->key_off + n;
+            t->count = t->key_len + n;
+            t->type = (uint8_t*)(t->count + n);
+            t->data = t->type + n;
+            nodes[0].type = TREE_MAP;
+            nodes[0].value = 1;
+            nodes[0].count = root.value;
+        }
+    }
+
+    for (size_t n = 0; n < t->node_count; n++) {
+        t->value[n] = nodes[n].value;
+        t->key_hash[n] = nodes[n].key_hash;
+        t->key_off[n] = nodes[n].key_off;
+        t->key_len[n] = nodes[n].key_len;
+        t->count[n] = nodes[n].count;
+        t->type[n] = nodes[n].type;
+    }
+    free(nodes);
+
+    log("in-memory tree built, %" PRIu64 " nodes, %" PRIu64 " bytes of data\n", t->node_count, t->data_len);
+    t->valid = true;
+    return true;
+}
+
+// Get the dec_* callbacks ready for the value of h->pointer alone. The value is handed to them as the only value
+// of a map whose key is the last segment of h->pointer, so that they accept it.
+static bool begin_value(cft_context_t* h) {
+    const cft_pointer_t* p = h->pointer;
+    const char* key = p->str + p->seg_off[p->depth - 1];
+    container_context_t cc = {0};
+    cc.type = CBOR_TYPE_MAP;
+    cc.size = 1;
+    cc.on_path = true;
+    cc.depth = p->depth - 1;
+    cc.path_len = key - p->str;
+    if (!reserve_key_path(h, p->len + 1) || !push(h, &cc)) {
+        return false;
+    }
+
+    container_context_t* cur_cc = get_top(h);
+    memcpy(h->key_path, p->str, p->len);
+    cur_cc->key_len = p->seg_len[p->depth - 1];
+    cur_cc->has_key = true;
+    cur_cc->keep_searching = true;
+    return true;
+}
+
+// Decode the value at the start of data into h->item.
+static cbor_item_t* decode_value_data(cft_context_t* h, cbor_data data, size_t len) {
+    if (!begin_value(h)) {
+        return NULL;
+    }
+
+    struct cbor_decoder_result decode_result = decode_item(h, data, len, &(h->dec_callbacks));
+    if (decode_result.status != CBOR_DECODER_FINISHED && h->err == CFT_ERR_OK) {
+        h->err = CFT_ERR_MALFORMATED_DATA;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to decode the value of \"%s\"", h->pointer->str);
+    }
+
+    // Drop the made up map if the decoder didn't get to the value
+    h->stack_top = -1;
+    if (h->err != CFT_ERR_OK) {
+        return NULL;
+    }
+
+    return &h->item;
+}
+
+// Decode the value at offset of the CBOR data into h->item.
+static cbor_item_t* decode_value(cft_context_t* h, size_t offset, size_t length) {
+    size_t avail = 0;
+    cbor_data data = read_document(h, offset, &avail);
+    if (avail < length && h->map == NULL) {
+        if (length > h->content_size && !grow_document_buffer(h, length)) {
+            return NULL;
+        }
+        h->content_avail = 0;
+        data = read_document(h, offset, &avail);
+    }
+
+    if (decode_value_data(h, data, avail) == NULL) {
+        return NULL;
+    }
+
+    h->value_offset = offset;
+    h->value_length = length;
+    return &h->item;
+}
+
+// Writers of the same file share their syncs: a writer that finds a sync of its file in progress waits for it,
+// and the next sync covers all the writers that queued up meanwhile. One group per file being synced.
+#define SYNC_GROUP_COUNT 16
+
+struct sync_group {
+    char path[MAX_PATH_LEN + sizeof(LOG_FILE_SUFFIX)];  ///< File or directory synced by the group
+    int users;                                         ///< Number of writers waiting on the group
+    bool syncing;                                      ///< Indicate whether a writer is syncing for the group
+    uint64_t written;                                  ///< Number of writes that asked the group for a sync
+    uint64_t synced;                                   ///< Last write covered by a successful sync
+    uint64_t failed;                                   ///< Last write covered by a failed sync
+};
+
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;
+static struct sync_group sync_groups[SYNC_GROUP_COUNT];
+
+// Sync the file through fd, or through a new file descriptor if fd is -1.
+static bool sync_file(const char* path, int fd, bool data_only) {
+    int sync_fd = fd >= 0 ? fd : open(path, O_RDONLY);
+    if (sync_fd < 0) {
+        return false;
+    }
+
+    bool ok = (data_only ? fdatasync(sync_fd) : fsync(sync_fd)) == 0;
+    if (fd < 0) {
+        close(sync_fd);
+    }
+
+    return ok;
+}
+
+// Make the writes done so far to the file or directory at path durable, along with the ones of the other
+// writers of the same path. fd is the writer's own descriptor of the file, or -1.
+static bool sync_path(const char* path, int fd, bool data_only) {
+    pthread_mutex_lock(&sync_lock);
+    struct sync_group* g = NULL;
+    for (int n = 0; n < SYNC_GROUP_COUNT && g == NULL; n++) {
+        if (strcmp(sync_groups[n].path, path) == 0) {
+            g = &sync_groups[n];
+        }
+    }
+
+    for (int n = 0; n < SYNC_GROUP_COUNT && g == NULL; n++) {
+        if (sync_groups[n].users == 0) {
+            g = &sync_groups[n];
+            memset(g, 0, sizeof(struct sync_group));
+            strncpy(g->path, path, sizeof(g->path) - 1);
+        }
+    }
+
+    if (g == NULL) {
+        // Too many files are being synced at once to keep track of this one
+        pthread_mutex_unlock(&sync_lock);
+        return sync_file(path, fd, data_only);
+    }
+
+    g->users++;
+    uint64_t ticket = ++g->written;
+    while (g->synced < ticket && g->failed < ticket) {
+        if (g->syncing) {
+            pthread_cond_wait(&sync_done, &sync_lock);
+            continue;
+        }
+
+        // Whatever was written before the sync starts is covered by it
+        g->syncing = true;
+        uint64_t target = g->written;
+        pthread_mutex_unlock(&sync_lock);
+        bool ok = sync_file(path, fd, data_only);
+        pthread_mutex_lock(&sync_lock);
+        g->syncing = false;
+        if (ok) {
+            g->synced = target;
+        } else {
+            g->failed = target;
+        }
+        pthread_cond_broadcast(&sync_done);
+    }
+
+    bool ok = g->synced >= ticket;
+    g->users--;
+    pthread_mutex_unlock(&sync_lock);
+    return ok;
+}
+
+// Sync the directory holding the file at path, so that a new name of the file survives a crash.
+static bool sync_parent(const char* path) {
+    char dir[MAX_PATH_LEN + sizeof(LOG_FILE_SUFFIX)];
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else {
+        size_t len = slash == path ? 1 : (size_t)(slash - path);
+        memcpy(dir, path, len);
+        dir[len] = 0;
+    }
+
+    return sync_path(dir, -1, false);
+}
+
+// The log holds one record per change, appended in order: a map of a single JSON Pointer to its new value,
+// or to null when the JSON Pointer is erased. Records are numbered from 1 in the order they were appended.
+struct log_record {
+    size_t pointer_off;  ///< Offset of the JSON Pointer in the log
+    size_t pointer_len;  ///< Length of the JSON Pointer
+    size_t value_off;    ///< Offset of the value in the log
+    size_t value_len;    ///< Encoded length of the value
+    bool erase;          ///< Indicate whether the record erases the JSON Pointer
+    size_t len;          ///< Encoded length of the whole record
+};
+
+static void get_log_path(cft_context_t* h, char* path, size_t size) {
+    snprintf(path, size, "%s%s", h->path, LOG_FILE_SUFFIX);
+}
+
+// Open the log file and lock it against the other writers, in this process or another. A compaction
+// removes the file it locked, so the file is opened again if it is no longer the one at the path.
+static int lock_log(const char* path, int flags) {
+    for (;;) {
+        int fd = open(path, flags, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+
+        struct stat st;
+        struct stat cur;
+        if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0) {
+            close(fd);
+            return -1;
+        }
+
+        if (stat(path, &cur) == 0 && cur.st_dev == st.st_dev && cur.st_ino == st.st_ino) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+static void free_log(cft_log_t* log) {
+    free(log->data);
+    free(log->entries);
+    free(log->slots);
+    log->data = NULL;
+    log->entries = NULL;
+    log->slots = NULL;
+    log->len = 0;
+    log->size = 0;
+    log->records = 0;
+    log->count = 0;
+    log->capacity = 0;
+    log->slot_count = 0;
+    log->loaded = false;
+}
+
+// Parse the record at offset. Return false if the log ends with an incomplete or unknown record.
+static bool parse_log_record(const uint8_t* data, size_t len, size_t offset, struct log_record* rec) {
+    struct cbor_head head;
+    size_t pos = offset;
+    if (!parse_head(data + pos, len - pos, &head) || head.major != CBOR_MAJOR_MAP || head.value != 1) {
+        return false;
+    }
+    pos += head.len;
+
+    if (!parse_head(data + pos, len - pos, &head) || head.major != CBOR_MAJOR_STRING || head.indefinite ||
+        head.value == 0 || head.value > MAX_POINTER_LEN || pos + head.len + head.value >= len) {
+        return false;
+    }
+    rec->pointer_off = pos + head.len;
+    rec->pointer_len = head.value;
+    pos += head.len + head.value;
+
+    if (!parse_head(data + pos, len - pos, &head)) {
+        return false;
+    }
+    rec->value_off = pos;
+    rec->erase = data[pos] == 0xf6;
+    if (rec->erase) {
+        rec->value_len = 1;
+    } else if (head.major == CBOR_MAJOR_STRING && !head.indefinite) {
+        rec->value_len = head.len + head.value;
+    } else {
+        return false;
+    }
+
+    if (rec->value_off + rec->value_len > len) {
+        return false;
+    }
+
+    rec->len = rec->value_off + rec->value_len - offset;
+    return true;
+}
+
+static cft_log_entry_t* find_log_entry(cft_log_t* log, const char* pointer, size_t len, uint32_t hash) {
+    if (log->slot_count == 0) {
+        return NULL;
+    }
+
+    size_t mask = log->slot_count - 1;
+    for (size_t i = hash & mask; log->slots[i] != 0; i = (i + 1) & mask) {
+        cft_log_entry_t* e = &log->entries[log->slots[i] - 1];
+        if (e->hash == hash && e->pointer_len == len && memcmp(log->data + e->pointer_off, pointer, len) == 0) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+// Return the entry of the JSON Pointer at pointer_off in the log, adding it if needed.
+static cft_log_entry_t* get_log_entry(cft_context_t* h, size_t pointer_off, size_t len, uint32_t hash) {
+    cft_log_t* log = &h->log;
+    cft_log_entry_t* e = find_log_entry(log, (const char*)log->data + pointer_off, len, hash);
+    if (e != NULL) {
+        return e;
+    }
+
+    if (log->count == log->capacity) {
+        size_t capacity = log->capacity ? log->capacity * 2 : 64;
+        cft_log_entry_t* entries = realloc(log->entries, capacity * sizeof(cft_log_entry_t));
+        if (entries == NULL) {
+            h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate log entries");
+            return NULL;
+        }
+        log->entries = entries;
+        log->capacity = capacity;
+    }
+
+    if ((log->count + 1) * 2 > log->slot_count) {
+        size_t slot_count = log->slot_count ? log->slot_count * 2 : 128;
+        uint32_t* slots = calloc(slot_count, sizeof(uint32_t));
+        if (slots == NULL) {
+            h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate log slots");
+            return NULL;
+        }
+
+        for (size_t n = 0; n < log->count; n++) {
+            size_t i = log->entries[n].hash & (slot_count - 1);
+            while (slots[i] != 0) {
+                i = (i + 1) & (slot_count - 1);
+            }
+            slots[i] = n + 1;
+        }
+        free(log->slots);
+        log->slots = slots;
+        log->slot_count = slot_count;
+    }
+
+    e = &log->entries[log->count];
+    memset(e, 0, sizeof(cft_log_entry_t));
+    e->hash = hash;
+    e->pointer_off = pointer_off;
+    e->pointer_len = len;
+
+    size_t i = hash & (log->slot_count - 1);
+    while (log->slots[i] != 0) {
+        i = (i + 1) & (log->slot_count - 1);
+    }
+    log->slots[i] = ++log->count;
+    return e;
+}
+
+// Account for the record at the end of the log: the JSON Pointer now has a new value or is erased,
+// and every map above it exists.
+static bool add_log_record(cft_context_t* h, const struct log_record* rec) {
+    cft_log_t* log = &h->log;
+    uint32_t seq = ++log->records;
+    const char* pointer = (const char*)log->data + rec->pointer_off;
+    uint32_t hash = HASH_POINTER_SEED;
+    size_t hashed = 0;
+    for (size_t n = 1; n <= rec->pointer_len; n++) {
+        if (n < rec->pointer_len && pointer[n] != '/') {
+            continue;
+        }
+
+        hash = hash_pointer_update(hash, pointer + hashed, n - hashed);
+        hashed = n;
+        cft_log_entry_t* e = get_log_entry(h, rec->pointer_off, n, hash);
+        if (e == NULL) {
+            return false;
+        }
+
+        if (n < rec->pointer_len) {
+            e->map_seq = seq;
+            continue;
+        }
+
+        e->seq = seq;
+        e->erase = rec->erase;
+        e->value_off = rec->value_off;
+        e->value_len = rec->value_len;
+    }
+
+    log->len += rec->len;
+    return true;
+}
+
+// Make sure the log matches the log file. The log is only read again when the file has changed.
+static bool load_log(cft_context_t* h) {
+    cft_log_t* log = &h->log;
+    char path[MAX_PATH_LEN + sizeof(LOG_FILE_SUFFIX)];
+    get_log_path(h, path, sizeof(path));
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        // No change has been logged
+        free_log(log);
+        memset(&log->stat, 0, sizeof(log->stat));
+        log->loaded = true;
+        return true;
+    }
+
+    if (log->loaded && !file_changed(path, &log->stat)) {
+        return true;
+    }
+
+    free_log(log);
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        h->err = CFT_ERR_OPEN_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open log \"%s\"", path);
+        return false;
+    }
+
+    size_t size = (size_t)st.st_size;
+    log->data = malloc(size > 0 ? size : 1);
+    if (log->data == NULL) {
+        fclose(fp);
+        h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate %" PRIu64 " bytes for log \"%s\"", size, path);
+        return false;
+    }
+    log->size = size;
+
+    size_t read = fread(log->data, 1, size, fp);
+    fclose(fp);
+
+    struct log_record rec;
+    while (log->len < read && parse_log_record(log->data, read, log->len, &rec)) {
+        if (!add_log_record(h, &rec)) {
+            free_log(log);
+            return false;
+        }
+    }
+
+    if (log->len < read) {
+        // Most likely a record cut short by a crash. It is dropped, and overwritten by the next record.
+        log("==> log \"%s\" ends with %" PRIu64 " bytes of incomplete record\n", path, read - log->len);
+    }
+
+    log->stat = st;
+    log->loaded = true;
+    log("==> log \"%s\" loaded, %" PRIu32 " records\n", path, log->records);
+    return true;
+}
+
+// Append a record setting the JSON Pointer to the given string, or erasing it if value is NULL.
+static cft_err_t append_log(cft_context_t* h, const cft_pointer_t* p, const uint8_t* value, size_t length) {
+    cft_log_t* log = &h->log;
+    char path[MAX_PATH_LEN + sizeof(LOG_FILE_SUFFIX)];
+    get_log_path(h, path, sizeof(path));
+
+    int fd = lock_log(path, O_WRONLY | O_CREAT);
+    if (fd < 0) {
+        h->err = CFT_ERR_OPEN_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open log \"%s\" for writing", path);
+        return h->err;
+    }
+
+    // Read the records the other writers appended, so that ours goes after them
+    if (!load_log(h)) {
+        close(fd);
+        return h->err;
+    }
+
+    unsigned char head[2 * MAX_INIT_BYTES_LEN] = {0};
+    unsigned char value_head[MAX_INIT_BYTES_LEN] = {0};
+    size_t head_len = cbor_encode_map_start(1, head, sizeof(head));
+    head_len += cbor_encode_string_start(p->len, head + head_len, sizeof(head) - head_len);
+    size_t value_head_len = value == NULL ? cbor_encode_null(value_head, sizeof(value_head))
+                                          : cbor_encode_string_start(length, value_head, sizeof(value_head));
+    size_t len = head_len + p->len + value_head_len + (value == NULL ? 0 : length);
+
+    if (log->len + len > log->size) {
+        size_t size = log->size ? log->size * 2 : 4096;
+        while (log->len + len > size) {
+            size *= 2;
+        }
+        uint8_t* data = realloc(log->data, size);
+        if (data == NULL) {
+            close(fd);
+            h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate %" PRIu64 " bytes for log \"%s\"", size, path);
+            return h->err;
+        }
+        log->data = data;
+        log->size = size;
+    }
+
+    // Write over whatever incomplete record the log may end with. No writer is in the middle of one while
+    // we hold the lock, so it was cut short by a crash.
+    struct iovec iov[4] = {{head, head_len}, {(void*)p->str, p->len}, {value_head, value_head_len}, {(void*)value, value == NULL ? 0 : length}};
+    ssize_t written = pwritev(fd, iov, 4, log->len);
+    bool ok = written == (ssize_t)len && ftruncate(fd, log->len + len) == 0 && fstat(fd, &log->stat) == 0;
+    if (ok && h->durability != CFT_DURABILITY_NONE) {
+        // The first record may have created the log
+        ok = sync_path(path, fd, true) && (h->durability != CFT_DURABILITY_FULL || log->len > 0 || sync_parent(path));
+    }
+    close(fd);
+    if (!ok) {
+        h->err = CFT_ERR_WRITE_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to append %" PRIu64 " bytes to log \"%s\"", len, path);
+        return h->err;
+    }
+
+    uint8_t* rec_data = log->data + log->len;
+    for (int n = 0; n < 4; n++) {
+        if (iov[n].iov_len > 0) {
+            memcpy(rec_data, iov[n].iov_base, iov[n].iov_len);
+            rec_data += iov[n].iov_len;
+        }
+    }
+
+    struct log_record rec;
+    if (!parse_log_record(log->data, log->len + len, log->len, &rec) || !add_log_record(h, &rec)) {
+        // Read the log file again next time
+        free_log(log);
+        return h->err;
+    }
+
+    log("==> %s \"%s\" logged (%" PRIu64 " bytes)\n", value == NULL ? "erase" : "set", p->str, len);
+
+    // The record is logged whether or not the compaction succeeds, and the next append tries it again
+    if (log->threshold > 0 && log->len >= log->threshold && cft_compact(h) != CFT_ERR_OK) {
+        log("==> log \"%s\" not compacted: %s\n", path, h->err_msg);
+        h->err = CFT_ERR_OK;
+    }
+
+    return h->err;
+}
+
+// Look the JSON Pointer up in the log. Return true if the log decides, with *item set to the value found
+// or NULL on error, and false if the CBOR data has to be searched.
+static bool get_logged_item(cft_context_t* h, cbor_item_t** item) {
+    const cft_pointer_t* p = h->pointer;
+    cft_log_t* log = &h->log;
+    if (log->count == 0 || p->depth == 0) {
+        return false;
+    }
+
+    cft_log_entry_t* e = find_log_entry(log, p->str, p->len, p->seg_hash[p->depth - 1]);
+    uint32_t seq = 0;
+    if (e != NULL) {
+        seq = e->seq > e->map_seq ? e->seq : e->map_seq;
+    }
+
+    // A map above the JSON Pointer that has been erased or set to a value since the JSON Pointer
+    // itself was last written hides it.
+    cft_log_entry_t* parent = NULL;
+    int parent_len = 0;
+    for (int depth = 0; depth < p->depth - 1; depth++) {
+        int len = pointer_prefix_len(p, depth);
+        cft_log_entry_t* pe = find_log_entry(log, p->str, len, p->seg_hash[depth]);
+        if (pe != NULL && pe->seq > seq && (parent == NULL || pe->seq > parent->seq)) {
+            parent = pe;
+            parent_len = len;
+        }
+    }
+
+    *item = NULL;
+    if (parent != NULL) {
+        if (parent->erase) {
+            h->err = CFT_ERR_POINTER_NOT_FOUND;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist, \"%.*s\" has been erased\n", p->str, parent_len, p->str);
+        } else {
+            h->err = CFT_ERR_WRONG_DATA_TYPE;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%.*s\" should be a map", parent_len, p->str);
+        }
+        return true;
+    }
+
+    if (e == NULL || seq == 0) {
+        return false;
+    }
+
+    if (e->map_seq > e->seq) {
+        h->err = CFT_ERR_POINTER_IS_MAP;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "pointer \"%s\" should not be a map", p->str);
+        return true;
+    }
+
+    if (e->erase) {
+        h->err = CFT_ERR_POINTER_NOT_FOUND;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist, it has been erased\n", p->str);
+        return true;
+    }
+
+    *item = decode_value_data(h, log->data + e->value_off, e->value_len);
+    return true;
+}
+
+static cbor_item_t* get_indexed_item(cft_context_t* h) {
+    const cft_pointer_t* p = h->pointer;
+    cft_index_entry_t* e = NULL;
+    if (p->depth > 0) {
+        e = find_index_entry(&h->index, p->str, p->len, p->seg_hash[p->depth - 1]);
+    }
+
+    if (e == NULL) {
+        // Look for the closest existing parent, to report the same error as a full scan would.
+        for (int depth = p->depth - 2; depth >= 0; depth--) {
+            int len = pointer_prefix_len(p, depth);
+            cft_index_entry_t* parent = find_index_entry(&h->index, p->str, len, p->seg_hash[depth]);
+            if (parent == NULL) {
+                continue;
+            }
+
+            if (parent->major != CBOR_MAJOR_MAP) {
+                h->err = CFT_ERR_WRONG_DATA_TYPE;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%.*s\" should be a map", len, p->str);
+                return NULL;
+            }
+
+            memset(h->insertion_map_pointer, 0, sizeof(h->insertion_map_pointer));
+            memcpy(h->insertion_map_pointer, p->str, len + 1);
+            h->insertion_depth = depth + 1;
+            break;
+        }
+
+        h->err = CFT_ERR_POINTER_NOT_FOUND;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist, but \"%s\" exists\n", p->str, h->insertion_map_pointer);
+        return NULL;
+    }
+
+    if (e->major == CBOR_MAJOR_MAP) {
+        h->err = CFT_ERR_POINTER_IS_MAP;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "pointer \"%s\" should not be a map", p->str);
+        return NULL;
+    }
+
+    return decode_value(h, e->offset, e->length);
+}
+
+// Find the child of the map node whose key is key. Return the child node, or 0 (the root) if there is none.
+static size_t find_tree_child(const cft_tree_t* t, size_t map, const char* key, size_t len) {
+    uint32_t hash = hash_pointer(key, len);
+    size_t lo = t->value[map];
+    size_t end = lo + t->count[map];
+    size_t hi = end;
+    while (hi - lo > TREE_SCAN_LEN) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (t->key_hash[mid] < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (size_t n = lo; n < end && t->key_hash[n] <= hash; n++) {
+        if (t->key_hash[n] == hash && t->key_len[n] == len && memcmp(t->data + t->key_off[n], key, len) == 0) {
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+// Hand the value of node n to the dec_* callbacks. Inline scalars go straight to their callback.
+static cbor_item_t* get_tree_value(cft_context_t* h, size_t n) {
+    const cft_tree_t* t = &h->tree;
+    if (t->type[n] == TREE_ENCODED) {
+        return decode_value_data(h, t->data + t->value[n], t->count[n]);
+    }
+
+    if (!begin_value(h)) {
+        return NULL;
+    }
+
+    const struct cbor_callbacks* cb = &h->dec_callbacks;
+    uint64_t v = t->value[n];
+    uint32_t bits = v;
+    float f;
+    double d;
+    memcpy(&f, &bits, sizeof(f));
+    memcpy(&d, &v, sizeof(d));
+    switch (t->type[n]) {
+        case TREE_UINT8:
+            cb->uint8(h, v);
+            break;
+        case TREE_UINT16:
+            cb->uint16(h, v);
+            break;
+        case TREE_UINT32:
+            cb->uint32(h, v);
+            break;
+        case TREE_UINT64:
+            cb->uint64(h, v);
+            break;
+        case TREE_NEGINT8:
+            cb->negint8(h, v);
+            break;
+        case TREE_NEGINT16:
+            cb->negint16(h, v);
+            break;
+        case TREE_NEGINT32:
+            cb->negint32(h, v);
+            break;
+        case TREE_NEGINT64:
+            cb->negint64(h, v);
+            break;
+        case TREE_FLOAT2:
+            cb->float2(h, f);
+            break;
+        case TREE_FLOAT4:
+            cb->float4(h, f);
+            break;
+        case TREE_FLOAT8:
+            cb->float8(h, d);
+            break;
+        case TREE_BOOL:
+            cb->boolean(h, v != 0);
+            break;
+        case TREE_NULL:
+            cb->null(h);
+            break;
+    }
+
+    h->stack_top = -1;
+    if (h->err != CFT_ERR_OK) {
+        return NULL;
+    }
+
+    return &h->item;
+}
+
+static cbor_item_t* get_tree_item(cft_context_t* h) {
+    const cft_pointer_t* p = h->pointer;
+    const cft_tree_t* t = &h->tree;
+    size_t node = 0;
+    for (int depth = 0; depth < p->depth; depth++) {
+        if (t->type[node] != TREE_MAP) {
+            h->err = CFT_ERR_WRONG_DATA_TYPE;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%.*s\" should be a map",
+                     depth > 0 ? pointer_prefix_len(p, depth - 1) : 1, p->str);
+            return NULL;
+        }
+
+        size_t child = find_tree_child(t, node, p->str + p->seg_off[depth], p->seg_len[depth]);
+        if (child == 0) {
+            if (depth > 0) {
+                memset(h->insertion_map_pointer, 0, sizeof(h->insertion_map_pointer));
+                memcpy(h->insertion_map_pointer, p->str, pointer_prefix_len(p, depth - 1) + 1);
+                h->insertion_depth = depth;
+            }
+            break;
+        }
+        node = child;
+
+        if (depth == p->depth - 1) {
+            if (t->type[node] == TREE_MAP) {
+                h->err = CFT_ERR_POINTER_IS_MAP;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "pointer \"%s\" should not be a map", p->str);
+                return NULL;
+            }
+
+            return get_tree_value(h, node);
+        }
+    }
+
+    h->err = CFT_ERR_POINTER_NOT_FOUND;
+    snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist, but \"%s\" exists\n", p->str, h->insertion_map_pointer);
+    return NULL;
+}
+
+static cbor_item_t* get_item(cft_context_t* h, const cft_pointer_t* pointer) {
+    h->pointer = pointer;
+    memset(h->insertion_map_pointer, 0, sizeof(h->insertion_map_pointer));
+    strncpy(h->insertion_map_pointer, ROOT_MAP_POINTER, MAX_POINTER_LEN);
+    h->insertion_depth = 0;
+    h->stack_top = -1;
+    h->pointer_found = false;
+    h->err = CFT_ERR_OK;
+    h->skip_value = false;
+
+    // A loaded tree answers without looking at the file, until the context rewrites it or cft_load is called again
+    if (h->tree.valid && !h->log.enabled) {
+        return get_tree_item(h);
+    }
+
+    if (!open_document(h)) {
+        return NULL;
+    }
+
+    if (h->log.enabled) {
+        cbor_item_t* item = NULL;
+        if (!load_log(h) || get_logged_item(h, &item)) {
+            return item;
+        }
+    }
+
+    if (h->tree.enabled) {
+        if (!h->tree.valid && !build_tree(h)) {
+            return NULL;
+        }
+
+        return get_tree_item(h);
+    }
+
+    if (h->index.enabled) {
+        if (!h->index.valid && !load_index(h)) {
+            return NULL;
+        }
+
+        return get_indexed_item(h);
+    }
+
+    decode_document(h, &(h->dec_callbacks), get_done);
+
+    if (h->err != CFT_ERR_OK) {
+        return NULL;
+    }
+
+    if (!h->pointer_found) {
+        h->err = CFT_ERR_POINTER_NOT_FOUND;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist, but \"%s\" exists\n", h->pointer->str, h->insertion_map_pointer);
+        return NULL;
+    }
+
+    return &h->item;
+}
+
+// Overwrite the value found by the last lookup with a new encoding of exactly the same length, given in pieces.
+// Nothing moves in the CBOR data, so the index stays valid, only its file needs to learn the new data hash.
+static cft_err_t set_item_in_place(cft_context_t* h, const struct iovec* iov, int iovcnt) {
+    size_t len = 0;
+    for (int n = 0; n < iovcnt; n++) {
+        len += iov[n].iov_len;
+    }
+
+    int fd = open(h->path, O_WRONLY);
+    if (fd < 0) {
+        h->err = CFT_ERR_OPEN_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open path \"%s\" for writing", h->path);
+        return h->err;
+    }
+
+    ssize_t written = pwritev(fd, iov, iovcnt, h->value_offset);
+    bool ok = written == (ssize_t)len && (h->durability == CFT_DURABILITY_NONE || sync_path(h->path, fd, true));
+    close(fd);
+    if (!ok) {
+        h->err = CFT_ERR_WRITE_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to write value at offset %" PRIu64 " of \"%s\"", h->value_offset, h->path);
+        return h->err;
+    }
+
+    log("==> value at offset %" PRIu64 " overwritten in place (%" PRIu64 " bytes)\n", h->value_offset, len);
+
+    // Drop the cached bytes and the file status of the old data, but keep the index.
+    bool index_valid = h->index.valid;
+    close_document(h);
+    if (!open_document(h)) {
+        return h->err;
+    }
+
+    h->index.valid = index_valid;
+    if (index_valid && h->index.use_file && !write_index_file(h)) {
+        // The write itself succeeded. The stale index file will be rebuilt by the next load.
+        log("==> fail to update index file\n");
+    }
+
+    return h->err;
+}
+
+// Swap the buffer the decode callbacks write the value to with another one.
+static void swap_output(cft_context_t* h, void** data, size_t* size) {
+    void* tmp_data = h->item.data;
+    size_t tmp_size = h->data_size;
+    h->item.data = *data;
+    h->data_size = *size;
+    *data = tmp_data;
+    *size = tmp_size;
+}
+
+struct batch_request {
+    const char* pointer;  ///< JSON Pointer to resolve
+    size_t len;           ///< Length of the JSON Pointer
+    size_t index;         ///< Index of the pointer in the caller's array
+    bool done;            ///< Indicate whether the request is found or ruled out
+};
+
+struct batch {
+    struct batch_request* requests;  ///< Requests sorted with compare_pointers()
+    cft_result_t* results;           ///< Results in the caller's order
+    size_t pending;                  ///< Number of requests neither found nor ruled out yet
+};
+
+// Order JSON Pointers as if '/' were the lowest character. The pointers under a given key then
+// come right after the key itself, and before any longer key having the same prefix.
+static int compare_pointers(const void* a, const void* b) {
+    const unsigned char* p = (const unsigned char*)((const struct batch_request*)a)->pointer;
+    const unsigned char* q = (const unsigned char*)((const struct batch_request*)b)->pointer;
+    for (;; p++, q++) {
+        int c = *p == '/' ? 1 : (*p == 0 ? 0 : *p + 1);
+        int d = *q == '/' ? 1 : (*q == 0 ? 0 : *q + 1);
+        if (c != d || c == 0) {
+            return c - d;
+        }
+    }
+}
+
+// Length of the segment of a request that starts at pos.
+static size_t segment_len(const struct batch_request* r, size_t pos) {
+    const char* end = memchr(r->pointer + pos, '/', r->len - pos);
+    return end ? (size_t)(end - r->pointer - pos) : r->len - pos;
+}
+
+// Compare the segment of a request that starts at pos with a key.
+static int compare_segment(const struct batch_request* r, size_t pos, const char* key, size_t key_len) {
+    size_t seg_len = segment_len(r, pos);
+    int res = memcmp(r->pointer + pos, key, seg_len < key_len ? seg_len : key_len);
+    if (res != 0) {
+        return res;
+    }
+
+    return seg_len < key_len ? -1 : (seg_len > key_len ? 1 : 0);
+}
+
+// Find the requests [*g_lo, *g_hi) among the sorted requests [lo, hi) whose segment that starts at pos is key.
+static void find_segment_group(const struct batch_request* requests, size_t lo, size_t hi, size_t pos, const char* key, size_t key_len,
+                               size_t* g_lo, size_t* g_hi) {
+    size_t l = lo, r = hi;
+    while (l < r) {
+        size_t m = l + (r - l) / 2;
+        if (compare_segment(&requests[m], pos, key, key_len) < 0) {
+            l = m + 1;
+        } else {
+            r = m;
+        }
+    }
+
+    *g_lo = l;
+    *g_hi = l;
+    while (*g_hi < hi && compare_segment(&requests[*g_hi], pos, key, key_len) == 0) {
+        (*g_hi)++;
+    }
+}
+
+static void batch_finish(struct batch* b, size_t r, cft_err_t err) {
+    b->results[b->requests[r].index].err = err;
+    b->requests[r].done = true;
+    b->pending--;
+}
+
+// Decode the value at offset straight into the buffer of a batch result.
+static cbor_item_t* decode_value_into(cft_context_t* h, size_t offset, size_t length, cft_result_t* res) {
+    void* data = res->item.data;
+    size_t size = res->data_size;
+    swap_output(h, &data, &size);
+    cbor_item_t* i = decode_value(h, offset, length);
+    swap_output(h, &data, &size);
+    if (i != NULL) {
+        res->item.type = i->type;
+        res->item.metadata = i->metadata;
+    }
+
+    return i;
+}
+
+static void batch_resolve(cft_context_t* h, struct batch* b, size_t r, size_t offset, size_t length) {
+    cft_result_t* res = &b->results[b->requests[r].index];
+    if (cft_pointer_compile(&h->compiled, b->requests[r].pointer) != CFT_ERR_OK) {
+        batch_finish(b, r, CFT_ERR_INSUFFICIENT_BUFFER);
+        return;
+    }
+
+    h->pointer = &h->compiled;
+    h->pointer_found = false;
+    cbor_item_t* i = decode_value_into(h, offset, length, res);
+    if (i == NULL) {
+        // Errors about a single value only concern its own request
+        batch_finish(b, r, h->err);
+        h->err = CFT_ERR_OK;
+        return;
+    }
+
+    batch_finish(b, r, CFT_ERR_OK);
+}
+
+// Resolve the requests [lo, hi) against the map whose content starts at *offset, and move *offset past the map.
+// All these requests start with path followed by '/'. Stops as soon as no request is pending anymore.
+static bool batch_map(cft_context_t* h, struct batch* b, size_t* offset, uint64_t size, char* path, size_t path_len, size_t lo, size_t hi) {
+    for (uint64_t n = 0; n < size && b->pending > 0; n++) {
+        struct cbor_head head;
+        if (!read_head(h, *offset, &head) || head.major != CBOR_MAJOR_STRING || head.indefinite) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is not a string", *offset);
+            return false;
+        }
+
+        size_t key_len = head.value;
+        const char* key = path + path_len + 1;
+        bool wanted = lo < hi && path_len + 1 + key_len <= MAX_POINTER_LEN;
+        if (wanted && !read_bytes(h, *offset + head.len, path + path_len + 1, key_len)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is truncated", *offset);
+            return false;
+        }
+        *offset += head.len + key_len;
+
+        // Find the requests whose next segment is this key
+        size_t g_lo = lo, g_hi = hi;
+        if (wanted) {
+            find_segment_group(b->requests, lo, hi, path_len + 1, key, key_len, &g_lo, &g_hi);
+        }
+
+        size_t value_offset = *offset;
+        if (!wanted || g_lo == g_hi) {
+            if (!skip_items(h, offset, 1)) {
+                h->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, value_offset);
+                return false;
+            }
+            continue;
+        }
+
+        if (!read_head(h, value_offset, &head)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to decode data item at offset %" PRIu64, value_offset);
+            return false;
+        }
+
+        // The requests for the key itself sort first in the group, the ones below it come after.
+        size_t child_len = path_len + 1 + key_len;
+        size_t deeper = g_lo;
+        while (deeper < g_hi && b->requests[deeper].len == child_len) {
+            deeper++;
+        }
+
+        size_t end = value_offset;
+        if (!skip_items(h, &end, 1)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, value_offset);
+            return false;
+        }
+
+        // A key the map holds twice only counts the first time
+        for (size_t r = g_lo; r < deeper; r++) {
+            if (b->requests[r].done) {
+                continue;
+            } else if (head.major == CBOR_MAJOR_MAP) {
+                batch_finish(b, r, CFT_ERR_POINTER_IS_MAP);
+            } else {
+                batch_resolve(h, b, r, value_offset, end - value_offset);
+            }
+        }
+
+        if (deeper < g_hi && head.major != CBOR_MAJOR_MAP) {
+            // We are searching /b/f/k, but /b/f is not a map
+            for (size_t r = deeper; r < g_hi; r++) {
+                if (!b->requests[r].done) {
+                    batch_finish(b, r, CFT_ERR_WRONG_DATA_TYPE);
+                }
+            }
+        } else if (deeper < g_hi) {
+            size_t inner = value_offset + head.len;
+            if (!batch_map(h, b, &inner, head.value, path, child_len, deeper, g_hi)) {
+                return false;
+            }
+        }
+
+        *offset = end;
+    }
+
+    // Once the whole map is read, the requests still pending below it are known not to exist
+    for (size_t r = lo; r < hi; r++) {
+        if (!b->requests[r].done) {
+            batch_finish(b, r, CFT_ERR_POINTER_NOT_FOUND);
+        }
+    }
+
+    return true;
+}
+
+// The first pass of a rewrite describes the new CBOR data as edits of the old one: each edit replaces len bytes
+// at offset with what its type says. All the bytes between the edits are copied as they are.
+enum txn_edit_type {
+    TXN_EDIT_KEEP,       ///< Nothing to change after all
+    TXN_EDIT_MAP_START,  ///< New initial bytes of a map whose size changes
+    TXN_EDIT_NEW_KEYS,   ///< Keys inserted by the requests [lo, hi) at the start of a map
+    TXN_EDIT_VALUE,      ///< New value of the set request lo
+    TXN_EDIT_ERASE       ///< Nothing, the key and value are erased
+};
+
+struct txn_edit {
+    enum txn_edit_type type;
+    size_t offset;  ///< Offset of the replaced bytes in the CBOR data
+    size_t len;     ///< Number of replaced bytes
+    size_t order;   ///< Index of the edit when it was added, to keep edits at the same offset in order
+    uint64_t size;  ///< New size of the map (TXN_EDIT_MAP_START)
+    size_t pos;     ///< Offset of the new keys in the JSON Pointers of the requests (TXN_EDIT_NEW_KEYS)
+    size_t lo;      ///< First request of the edit
+    size_t hi;      ///< One past the last request of the edit
+    size_t pad;     ///< Padding of the value replaced (TXN_EDIT_VALUE)
+};
+
+struct txn {
+    const cft_txn_t* txn;            ///< Operations to apply
+    cft_read_cb_t read_cb;           ///< Source of the value of the only set operation, if it is streamed
+    void* user;                      ///< Argument of read_cb
+    size_t stream_len;               ///< Length of the streamed value
+    struct batch_request* requests;  ///< Operations sorted with compare_pointers(), index is the operation index
+    char* pointers;                  ///< NUL terminated copies of the JSON Pointers of the requests
+    bool* matched;                   ///< Indicate whether the segment of each request matches a key of the current map
+    struct txn_edit* edits;          ///< Edits of the CBOR data, sorted by offset once all are known
+    size_t edit_count;               ///< Number of edits
+    size_t edit_capacity;            ///< Number of allocated edits
+    char path[MAX_POINTER_LEN + 1];  ///< JSON Pointer of the current key
+};
+
+// Ranges at least this long are copied file to file by the kernel rather than through the output buffer
+#define COPY_RANGE_MIN_LEN 4096
+
+// Copy len bytes of the CBOR data starting at offset to the output file, as they are.
+// Long ranges never enter user space when the file system allows it, the rest goes through read_document().
+static bool copy_range(cft_context_t* h, size_t offset, size_t len) {
+    if (len >= COPY_RANGE_MIN_LEN) {
+        if (!flush_output(h, NULL, 0)) {
+            return false;
+        }
+
+        off64_t in_offset = offset;
+        while (len > 0) {
+            ssize_t n = copy_file_range(fileno(h->fd), &in_offset, h->out.fd, NULL, len, 0);
+            if (n <= 0) {
+                break;
+            }
+            h->out.bytes_written += n;
+            h->out.bytes_copied += n;
+            len -= n;
+        }
+        offset = in_offset;
+    }
+
+    while (len > 0) {
+        size_t avail = 0;
+        cbor_data data = read_document(h, offset, &avail);
+        if (avail == 0) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "data item at offset %" PRIu64 " is truncated", offset);
+            return false;
+        }
+
+        size_t n = avail < len ? avail : len;
+        if (!write_output(h, data, n)) {
+            return false;
+        }
+        offset += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static void write_map_start(cft_context_t* h, size_t size) {
+    unsigned char buf[MAX_INIT_BYTES_LEN] = {0};
+    size_t written = cbor_encode_map_start(size, buf, sizeof(buf));
+    write_output(h, buf, written);
+}
+
+// Write the new value of a set operation, padded like the value it replaces if that one is padded.
+static void write_txn_value(cft_context_t* h, const struct txn* t, const struct batch_request* r, size_t pad) {
+    const cft_txn_op_t* op = &t->txn->ops[r->index];
+    if (t->read_cb != NULL) {
+        write_stream_slot(h, t->stream_len, t->read_cb, t->user, h->slack > 0 ? h->slack : pad);
+        return;
+    }
+
+    write_slot(h, CBOR_MAJOR_STRING, (cbor_data)t->txn->pool + op->value_off, op->value_len, h->slack > 0 ? h->slack : pad);
+}
+
+// Read the key at *offset into t->path right after the map pointer, and move *offset past it.
+// *wanted is false if the key doesn't fit in t->path, in which case no request can match it.
+static bool read_txn_key(cft_context_t* h, struct txn* t, size_t* offset, size_t path_len, size_t* key_len, bool* wanted) {
+    struct cbor_head head;
+    if (!read_head(h, *offset, &head) || head.major != CBOR_MAJOR_STRING || head.indefinite) {
+        h->err = CFT_ERR_MALFORMATED_DATA;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is not a string", *offset);
+        return false;
+    }
+
+    *key_len = head.value;
+    *wanted = path_len + 1 + head.value <= MAX_POINTER_LEN;
+    t->path[path_len] = '/';
+    if (*wanted && !read_bytes(h, *offset + head.len, t->path + path_len + 1, head.value)) {
+        h->err = CFT_ERR_MALFORMATED_DATA;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is truncated", *offset);
+        return false;
+    }
+
+    *offset += head.len + head.value;
+    return true;
+}
+
+// Number of distinct segments that start at pos among the requests [lo, hi).
+static size_t count_segments(const struct txn* t, size_t pos, size_t lo, size_t hi) {
+    size_t count = 0;
+    for (size_t r = lo; r < hi; r++) {
+        const struct batch_request* req = &t->requests[r];
+        if (r == lo || compare_segment(&t->requests[r - 1], pos, req->pointer + pos, segment_len(req, pos)) != 0) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+// Write a key for every distinct segment that starts at pos among the requests [lo, hi), none of which exists yet.
+// The value of a key is either the new value of its request, or a new map holding the requests below it.
+static void write_new_keys(cft_context_t* h, struct txn* t, size_t pos, size_t lo, size_t hi) {
+    size_t r = lo;
+    while (r < hi) {
+        const struct batch_request* req = &t->requests[r];
+        size_t seg_len = segment_len(req, pos);
+        size_t end = r + 1;
+        while (end < hi && compare_segment(&t->requests[end], pos, req->pointer + pos, seg_len) == 0) {
+            end++;
+        }
+
+        write_slot(h, CBOR_MAJOR_STRING, (cbor_data)req->pointer + pos, seg_len, 0);
+        log("==> insert key \"%.*s\"\n", (int)(pos + seg_len), req->pointer);
+        if (req->len == pos + seg_len) {
+            write_txn_value(h, t, req, 0);
+        } else {
+            write_map_start(h, count_segments(t, pos + seg_len + 1, r, end));
+            write_new_keys(h, t, pos + seg_len + 1, r, end);
+        }
+        r = end;
+    }
+}
+
+static bool add_edit(cft_context_t* h, struct txn* t, enum txn_edit_type type, size_t offset, size_t len, size_t* n) {
+    if (t->edit_count == t->edit_capacity) {
+        size_t capacity = t->edit_capacity ? t->edit_capacity * 2 : 16;
+        struct txn_edit* edits = realloc(t->edits, capacity * sizeof(struct txn_edit));
+        if (edits == NULL) {
+            h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate rewrite edits");
+            return false;
+        }
+        t->edits = edits;
+        t->edit_capacity = capacity;
+    }
+
+    *n = t->edit_count++;
+    struct txn_edit* e = &t->edits[*n];
+    memset(e, 0, sizeof(struct txn_edit));
+    e->type = type;
+    e->offset = offset;
+    e->len = len;
+    e->order = *n;
+    return true;
+}
+
+// Edits sort by offset. Insertions replace nothing, so they go before an edit at the same offset that replaces bytes.
+static int compare_edits(const void* a, const void* b) {
+    const struct txn_edit* ea = a;
+    const struct txn_edit* eb = b;
+    if (ea->offset != eb->offset) {
+        return ea->offset < eb->offset ? -1 : 1;
+    }
+
+    if ((ea->len == 0) != (eb->len == 0)) {
+        return ea->len == 0 ? -1 : 1;
+    }
+
+    return ea->order < eb->order ? -1 : ea->order > eb->order;
+}
+
+// Find the keys of the map at offset that the requests [lo, hi) are on, check the requests against them, and
+// add the edits applying the requests. All these requests start with t->path up to path_len, followed by '/'.
+// Keys are only looked at until every request has found its key, the rest of the map doesn't matter.
+static bool txn_map(cft_context_t* h, struct txn* t, size_t offset, const struct cbor_head* map, size_t path_len, size_t lo, size_t hi) {
+    size_t pos = path_len + 1;
+    const cft_txn_op_t* ops = t->txn->ops;
+    memset(t->matched + lo, 0, (hi - lo) * sizeof(bool));
+
+    // The new initial bytes of the map depend on what the requests find in it
+    size_t map_edit;
+    if (!add_edit(h, t, TXN_EDIT_MAP_START, offset, map->len, &map_edit)) {
+        return false;
+    }
+
+    size_t unmatched = hi - lo;
+    uint64_t removed = 0;
+    size_t cur = offset + map->len;
+    for (uint64_t n = 0; n < map->value && unmatched > 0; n++) {
+        size_t key_offset = cur;
+        size_t key_len;
+        bool wanted;
+        if (!read_txn_key(h, t, &cur, path_len, &key_len, &wanted)) {
+            return false;
+        }
+
+        size_t g_lo = lo, g_hi = lo;
+        if (wanted) {
+            find_segment_group(t->requests, lo, hi, pos, t->path + pos, key_len, &g_lo, &g_hi);
+        }
+
+        size_t value_offset = cur;
+        struct cbor_head head;
+        if (g_lo < g_hi && !read_head(h, value_offset, &head)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to decode data item at offset %" PRIu64, value_offset);
+            return false;
+        }
+
+        const struct batch_request* req = &t->requests[g_lo];
+        if (g_lo == g_hi || req->len == pos + key_len) {
+            if (!skip_items(h, &cur, 1)) {
+                h->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, value_offset);
+                return false;
+            }
+
+            if (g_lo == g_hi) {
+                continue;
+            }
+        }
+
+        for (size_t r = g_lo; r < g_hi; r++) {
+            t->matched[r] = true;
+        }
+        unmatched -= g_hi - g_lo;
+
+        size_t e;
+        if (req->len == pos + key_len && ops[req->index].type == CFT_TXN_ERASE) {
+            log("==> erase key \"%.*s\"\n", (int)req->len, req->pointer);
+            if (!add_edit(h, t, TXN_EDIT_ERASE, key_offset, cur - key_offset, &e)) {
+                return false;
+            }
+            removed++;
+        } else if (req->len == pos + key_len) {
+            if (head.major == CBOR_MAJOR_MAP) {
+                h->err = CFT_ERR_POINTER_IS_MAP;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "pointer \"%.*s\" should not be a map", (int)req->len, req->pointer);
+                return false;
+            }
+
+            struct cbor_slot slot = {0};
+            if (head.indefinite && !read_slot(h, value_offset, &slot)) {
+                h->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to decode data item at offset %" PRIu64, value_offset);
+                return false;
+            }
+
+            log("==> set key \"%.*s\"\n", (int)req->len, req->pointer);
+            if (!add_edit(h, t, TXN_EDIT_VALUE, value_offset, cur - value_offset, &e)) {
+                return false;
+            }
+            t->edits[e].lo = g_lo;
+            t->edits[e].hi = g_lo + 1;
+            t->edits[e].pad = slot.pad;
+        } else {
+            if (head.major != CBOR_MAJOR_MAP) {
+                h->err = CFT_ERR_WRONG_DATA_TYPE;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%.*s\" should be a map", (int)(pos + key_len), req->pointer);
+                return false;
+            }
+
+            // The nested map clears the matches of its requests for its own keys
+            if (!txn_map(h, t, value_offset, &head, pos + key_len, g_lo, g_hi)) {
+                return false;
+            }
+
+            for (size_t r = g_lo; r < g_hi; r++) {
+                t->matched[r] = true;
+            }
+
+            // Only the keys after the nested map need its end
+            if (unmatched > 0 && !skip_items(h, &cur, 1)) {
+                h->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, value_offset);
+                return false;
+            }
+        }
+    }
+
+    // The requests that match no key insert new keys, unless they erase something that doesn't exist.
+    // Like a single insertion, the new keys come first in the map.
+    uint64_t inserted = 0;
+    for (size_t r = lo; r < hi;) {
+        if (t->matched[r]) {
+            r++;
+            continue;
+        }
+
+        size_t end = r;
+        while (end < hi && !t->matched[end]) {
+            const struct batch_request* req = &t->requests[end];
+            if (ops[req->index].type == CFT_TXN_ERASE) {
+                h->err = CFT_ERR_POINTER_NOT_FOUND;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%.*s\" doesn't exist", (int)req->len, req->pointer);
+                return false;
+            }
+
+            end++;
+        }
+
+        size_t e;
+        if (!add_edit(h, t, TXN_EDIT_NEW_KEYS, offset + map->len, 0, &e)) {
+            return false;
+        }
+        t->edits[e].pos = pos;
+        t->edits[e].lo = r;
+        t->edits[e].hi = end;
+        inserted += count_segments(t, pos, r, end);
+        r = end;
+    }
+
+    struct txn_edit* e = &t->edits[map_edit];
+    if (removed == 0 && inserted == 0) {
+        e->type = TXN_EDIT_KEEP;
+        e->len = 0;
+    } else {
+        e->size = map->value - removed + inserted;
+    }
+
+    return true;
+}
+
+// Write the new CBOR data: the old one with the edits applied.
+static bool write_edits(cft_context_t* h, struct txn* t) {
+    size_t cur = 0;
+    for (size_t n = 0; n < t->edit_count; n++) {
+        const struct txn_edit* e = &t->edits[n];
+        if (e->type == TXN_EDIT_KEEP) {
+            continue;
+        }
+
+        if (!copy_range(h, cur, e->offset - cur)) {
+            return false;
+        }
+
+        if (e->type == TXN_EDIT_MAP_START) {
+            write_map_start(h, e->size);
+        } else if (e->type == TXN_EDIT_NEW_KEYS) {
+            write_new_keys(h, t, e->pos, e->lo, e->hi);
+        } else if (e->type == TXN_EDIT_VALUE) {
+            write_txn_value(h, t, &t->requests[e->lo], e->pad);
+        }
+        cur = e->offset + e->len;
+    }
+
+    return copy_range(h, cur, h->content_len - cur) && h->err == CFT_ERR_OK;
+}
+
+static void free_txn(cft_txn_t* txn) {
+    free(txn->ops);
+    free(txn->pool);
+    memset(txn, 0, sizeof(cft_txn_t));
+}
+
+// Queue an operation on the JSON Pointer. An operation replaces the one already queued on the same
+// JSON Pointer, as well as the ones below it.
+static cft_err_t txn_add(cft_context_t* h, cft_txn_t* txn, const cft_pointer_t* p, cft_txn_op_type_t type, const unsigned char* v, size_t len) {
+    h->err = CFT_ERR_OK;
+    if (!txn->active) {
+        h->err = CFT_ERR_NO_TRANSACTION;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "no transaction has begun");
+        return h->err;
+    }
+
+    if (p->depth == 0) {
+        h->err = CFT_ERR_POINTER_NOT_FOUND;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "cannot find '/' in the pointer \"%s\"", p->str);
+        return h->err;
+    }
+
+    if (len >= h->data_size) {
+        h->err = CFT_ERR_INSUFFICIENT_BUFFER;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for value (%" PRIu64 " bytes)", len);
+        return h->err;
+    }
+
+    size_t kept = 0;
+    for (size_t n = 0; n < txn->count; n++) {
+        const cft_txn_op_t* op = &txn->ops[n];
+        const char* q = txn->pool + op->pointer_off;
+        size_t q_len = op->pointer_len;
+        if (q_len < p->len && memcmp(q, p->str, q_len) == 0 && p->str[q_len] == '/') {
+            // A queued operation already replaced a map above the JSON Pointer with a value, or erased it
+            h->err = op->type == CFT_TXN_ERASE ? CFT_ERR_POINTER_NOT_FOUND : CFT_ERR_WRONG_DATA_TYPE;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%.*s\" is %s in this transaction", (int)q_len, q,
+                     op->type == CFT_TXN_ERASE ? "erased" : "set to a value");
+            return h->err;
+        }
+
+        if (q_len >= p->len && memcmp(q, p->str, p->len) == 0 && (q_len == p->len || q[p->len] == '/')) {
+            continue;
+        }
+
+        txn->ops[kept++] = *op;
+    }
+    txn->count = kept;
+
+    if (txn->count == txn->capacity) {
+        size_t capacity = txn->capacity ? txn->capacity * 2 : 16;
+        cft_txn_op_t* ops = realloc(txn->ops, capacity * sizeof(cft_txn_op_t));
+        if (ops == NULL) {
+            h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate transaction operations");
+            return h->err;
+        }
+        txn->ops = ops;
+        txn->capacity = capacity;
+    }
+
+    if (txn->pool_len + p->len + len > txn->pool_size) {
+        size_t size = txn->pool_size ? txn->pool_size * 2 : 4096;
+        while (txn->pool_len + p->len + len > size) {
+            size *= 2;
+        }
+        char* pool = realloc(txn->pool, size);
+        if (pool == NULL) {
+            h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate transaction pool");
+            return h->err;
+        }
+        txn->pool = pool;
+        txn->pool_size = size;
+    }
+
+    cft_txn_op_t* op = &txn->ops[txn->count++];
+    op->type = type;
+    op->pointer_off = txn->pool_len;
+    op->pointer_len = p->len;
+    memcpy(txn->pool + txn->pool_len, p->str, p->len);
+    txn->pool_len += p->len;
+    op->value_off = txn->pool_len;
+    op->value_len = len;
+    if (len > 0) {
+        memcpy(txn->pool + txn->pool_len, v, len);
+        txn->pool_len += len;
+    }
+
+    return h->err;
+}
+
+static void free_rewrite(struct txn* t) {
+    free(t->requests);
+    free(t->pointers);
+    free(t->matched);
+    free(t->edits);
+    memset(t, 0, sizeof(struct txn));
+}
+
+// Find where the operations apply to the CBOR data, and check them against it, in a single pass that only
+// goes along the JSON Pointers of the operations. The result is the list of edits write_rewrite() applies.
+static bool plan_rewrite(cft_context_t* h, struct txn* t, const cft_txn_t* txn) {
+    memset(t, 0, sizeof(struct txn));
+    t->txn = txn;
+    h->err = CFT_ERR_OK;
+    if (!open_document(h)) {
+        return false;
+    }
+
+    // compare_pointers() needs NUL terminated JSON Pointers, which the pool doesn't have
+    t->requests = malloc(txn->count * sizeof(struct batch_request));
+    t->pointers = malloc(txn->pool_len + txn->count);
+    t->matched = malloc(txn->count * sizeof(bool));
+    if (t->requests == NULL || t->pointers == NULL || t->matched == NULL) {
+        h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate transaction requests");
+        return false;
+    }
+
+    char* pointer = t->pointers;
+    for (size_t n = 0; n < txn->count; n++) {
+        memcpy(pointer, txn->pool + txn->ops[n].pointer_off, txn->ops[n].pointer_len);
+        pointer[txn->ops[n].pointer_len] = 0;
+        t->requests[n].pointer = pointer;
+        t->requests[n].len = txn->ops[n].pointer_len;
+        t->requests[n].index = n;
+        pointer += txn->ops[n].pointer_len + 1;
+    }
+    qsort(t->requests, txn->count, sizeof(struct batch_request), compare_pointers);
+
+    struct cbor_head head;
+    if (!read_head(h, 0, &head) || head.major != CBOR_MAJOR_MAP) {
+        h->err = CFT_ERR_MALFORMATED_DATA;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "the root data item is not a map");
+        return false;
+    }
+
+    if (!txn_map(h, t, 0, &head, 0, 0, txn->count)) {
+        return false;
+    }
+
+    qsort(t->edits, t->edit_count, sizeof(struct txn_edit), compare_edits);
+    return true;
+}
+
+// Write the CBOR data planned by plan_rewrite() next to the old one, and rename it over it.
+// The untouched keys and values are copied as they are, range by range. Nothing changes if anything fails.
+static cft_err_t write_rewrite(cft_context_t* h, struct txn* t) {
+    char tmp_name[MAX_PATH_LEN + 8];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.XXXXXX", h->path);
+    int fd = mkstemp(tmp_name);
+    if (fd < 0) {
+        h->err = CFT_ERR_CREATE_TEMP_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open temp file \"%s\"", tmp_name);
+        return h->err;
+    }
+
+    // mkstemp() only lets the owner read the file, the new data gets the permissions of the old one
+    if (!open_output(h, fd) || fchmod(fd, h->content_stat.st_mode & 07777) != 0) {
+        if (h->err == CFT_ERR_OK) {
+            h->err = CFT_ERR_CREATE_TEMP_FILE_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to set the permissions of temp file \"%s\"", tmp_name);
+        }
+        close(fd);
+        remove(tmp_name);
+        return h->err;
+    }
+
+    write_edits(h, t);
+    if (close_output(h)) {
+        // The file is about to be replaced, so the open document is no longer valid.
+        close_document(h);
+        if (rename(tmp_name, h->path) != 0) {
+            h->err = CFT_ERR_WRITE_FILE_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to replace \"%s\"", h->path);
+        }
+    }
+
+    if (h->err != CFT_ERR_OK) {
+        remove(tmp_name);
+        return h->err;
+    }
+
+    if (h->durability == CFT_DURABILITY_FULL && !sync_parent(h->path)) {
+        h->err = CFT_ERR_WRITE_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to sync the directory of \"%s\"", h->path);
+        return h->err;
+    }
+
+    log("==> %" PRIu64 " operations committed, %" PRIu64 " bytes written (%" PRIu64 " in %" PRIu64 " writes, %" PRIu64 " copied)\n",
+        t->txn->count, h->out.bytes_written, h->out.bytes_flushed, h->out.flush_count, h->out.bytes_copied);
+    update_index_file(h);
+    return h->err;
+}
+
+// Apply the operations in a single rewrite of the CBOR data.
+static cft_err_t rewrite_document(cft_context_t* h, const cft_txn_t* txn) {
+    struct txn t;
+    if (plan_rewrite(h, &t, txn)) {
+        write_rewrite(h, &t);
+    }
+
+    free_rewrite(&t);
+    return h->err;
+}
+
+// Rewrite the CBOR data with a single operation on the JSON Pointer.
+static cft_err_t rewrite_item(cft_context_t* h, const cft_pointer_t* p, cft_txn_op_type_t type, const unsigned char* v, size_t len) {
+    cft_txn_t txn = {0};
+    txn.active = true;
+    if (txn_add(h, &txn, p, type, v, len) == CFT_ERR_OK) {
+        rewrite_document(h, &txn);
+    }
+
+    free_txn(&txn);
+    return h->err;
+}
+
+cft_err_t cft_pointer_compile(cft_pointer_t* p, const char* pointer) {
+    size_t len = strlen(pointer);
+    if (len > MAX_POINTER_LEN) {
+        return CFT_ERR_INSUFFICIENT_BUFFER;
+    }
+
+    memcpy(p->str, pointer, len + 1);
+    p->len = len;
+    p->depth = 0;
+
+    // A pointer that doesn't start with '/' has no segment, so it never matches any key.
+    if (len == 0 || pointer[0] != '/') {
+        return CFT_ERR_OK;
+    }
+
+    // Every segment ends either at the next '/' or at the end of the pointer. The hash of
+    // each prefix is the index hash of the parent pointers, so it's computed on the way.
+    uint32_t hash = hash_pointer_update(HASH_POINTER_SEED, pointer, 1);
+    size_t start = 1;
+    for (size_t i = 1; i <= len; i++) {
+        if (i == len || pointer[i] == '/') {
+            if (p->depth == MAX_POINTER_DEPTH) {
+                p->depth = 0;
+                return CFT_ERR_INSUFFICIENT_BUFFER;
+            }
+
+            p->seg_off[p->depth] = start;
+            p->seg_len[p->depth] = i - start;
+            p->seg_hash[p->depth] = hash;
+            p->depth++;
+            start = i + 1;
+        }
+
+        if (i < len) {
+            hash = hash_pointer_update(hash, pointer + i, 1);
+        }
+    }
+
+    return CFT_ERR_OK;
+}
+
+// Compile a pointer given as a string into the context.
+static const cft_pointer_t* compile_pointer(cft_context_t* h, const char* pointer) {
+    h->err = cft_pointer_compile(&h->compiled, pointer);
+    if (h->err != CFT_ERR_OK) {
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for pointer \"%.32s...\"", pointer);
+        return NULL;
+    }
+
+    return &h->compiled;
+}
+
+uint8_t cft_get_uint8(cft_context_t* h, const char* pointer) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return 0;
+    }
+
+    return cft_get_uint8_p(h, p);
+}
+
+uint8_t cft_get_uint8_p(cft_context_t* h, const cft_pointer_t* p) {
+    cbor_item_t* i = get_item(h, p);
+    if (i == NULL) {
+        return 0;
+    }
+
+    if (!cbor_isa_uint(i) || cbor_int_get_width(i) != CBOR_INT_8) {
+#if ENABLE_LOG == 1
+        cbor_describe(i, stdout);
+#endif
+
+        h->err = CFT_ERR_WRONG_DATA_TYPE;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a uint8\n", h->pointer->str);
+        return 0;
+    }
+
+    return cbor_get_uint8(i);
+}
+
+uint16_t cft_get_uint16(cft_context_t* h, const char* pointer) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return 0;
+    }
+
+    return cft_get_uint16_p(h, p);
+}
+
+uint16_t cft_get_uint16_p(cft_context_t* h, const cft_pointer_t* p) {
+    cbor_item_t* i = get_item(h, p);
+    if (i == NULL) {
+        return 0;
+    }
+
+    if (!cbor_isa_uint(i) || cbor_int_get_width(i) != CBOR_INT_16) {
+#if ENABLE_LOG == 1
+        cbor_describe(i, stdout);
+#endif
+
+        h->err = CFT_ERR_WRONG_DATA_TYPE;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a uint16\n", h->pointer->str);
+        return 0;
+    }
+
+    return cbor_get_uint16(i);
+}
+
+const unsigned char* cft_get_sz(cft_context_t* h, const char* pointer) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    return cft_get_sz_p(h, p);
+}
+
+const unsigned char* cft_get_sz_p(cft_context_t* h, const cft_pointer_t* p) {
+    cbor_item_t* i = get_item(h, p);
+    if (i == NULL) {
+        return 0;
+    }
+
+    if (!cbor_isa_string(i)) {
+#if ENABLE_LOG == 1
+        cbor_describe(i, stdout);
+#endif
+
+        h->err = CFT_ERR_WRONG_DATA_TYPE;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a null-terminated string\n", h->pointer->str);
+        return 0;
+    }
+
+    return cbor_string_handle(i);
+}
+
+// Look up a string or a byte string, and let the decode callbacks write it straight into the caller's buffer.
+static cft_err_t get_into(cft_context_t* h, const cft_pointer_t* p, cbor_type type, void* buf, size_t size, size_t* len) {
+    void* data = buf;
+    swap_output(h, &data, &size);
+
+    cbor_item_t* i = get_item(h, p);
+    if (i != NULL && cbor_typeof(i) != type) {
+#if ENABLE_LOG == 1
+        cbor_describe(i, stdout);
+#endif
+
+        h->err = CFT_ERR_WRONG_DATA_TYPE;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a %s\n", h->pointer->str,
+                 type == CBOR_TYPE_STRING ? "null-terminated string" : "byte string");
+    } else if (i != NULL && len != NULL) {
+        *len = type == CBOR_TYPE_STRING ? cbor_string_length(i) : cbor_bytestring_length(i);
+    }
+
+    swap_output(h, &data, &size);
+    return h->err;
+}
+
+cft_err_t cft_get_sz_into(cft_context_t* h, const char* pointer, char* buf, size_t size) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_get_sz_into_p(h, p, buf, size);
+}
+
+cft_err_t cft_get_sz_into_p(cft_context_t* h, const cft_pointer_t* p, char* buf, size_t size) {
+    return get_into(h, p, CBOR_TYPE_STRING, buf, size, NULL);
+}
+
+cft_err_t cft_get_bytes_into(cft_context_t* h, const char* pointer, uint8_t* buf, size_t size, size_t* len) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_get_bytes_into_p(h, p, buf, size, len);
+}
+
+cft_err_t cft_get_bytes_into_p(cft_context_t* h, const cft_pointer_t* p, uint8_t* buf, size_t size, size_t* len) {
+    return get_into(h, p, CBOR_TYPE_BYTESTRING, buf, size, len);
+}
+
+// Look up a string or a byte string, and return where it is in the CBOR data instead of copying it.
+// In mmap mode the view points into the mapped file, and stays valid until the file is written or reloaded.
+// In stream mode it points into the read buffer, and is only valid until the next call on the context.
+static cft_err_t get_view(cft_context_t* h, const cft_pointer_t* p, cbor_type type, cft_view_t* view) {
+    h->view = true;
+    cbor_item_t* i = get_item(h, p);
+    h->view = false;
+    if (i == NULL) {
+        return h->err;
+    }
+
+    if (cbor_typeof(i) != type) {
+        h->err = CFT_ERR_WRONG_DATA_TYPE;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a %s\n", h->pointer->str,
+                 type == CBOR_TYPE_STRING ? "string" : "byte string");
+        return h->err;
+    }
+
+    view->ptr = h->view_data;
+    view->len = type == CBOR_TYPE_STRING ? cbor_string_length(i) : cbor_bytestring_length(i);
+    return h->err;
+}
+
+cft_err_t cft_get_sz_view(cft_context_t* h, const char* pointer, cft_view_t* view) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_get_sz_view_p(h, p, view);
+}
+
+cft_err_t cft_get_sz_view_p(cft_context_t* h, const cft_pointer_t* p, cft_view_t* view) {
+    return get_view(h, p, CBOR_TYPE_STRING, view);
+}
+
+cft_err_t cft_get_bytes_view(cft_context_t* h, const char* pointer, cft_view_t* view) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_get_bytes_view_p(h, p, view);
+}
+
+cft_err_t cft_get_bytes_view_p(cft_context_t* h, const cft_pointer_t* p, cft_view_t* view) {
+    return get_view(h, p, CBOR_TYPE_BYTESTRING, view);
+}
+
+cft_err_t cft_get_uint(cft_context_t* h, const char* pointer, uint64_t* v) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_get_uint_p(h, p, v);
+}
+
+cft_err_t cft_get_uint_p(cft_context_t* h, const cft_pointer_t* p, uint64_t* v) {
+    cbor_item_t* i = get_item(h, p);
+    if (i == NULL) {
+        return h->err;
+    }
+
+    if (!cbor_isa_uint(i)) {
+#if ENABLE_LOG == 1
+        cbor_describe(i, stdout);
+#endif
+
+        h->err = CFT_ERR_WRONG_DATA_TYPE;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a uint\n", h->pointer->str);
+        return h->err;
+    }
+
+    // Whatever the encoded width is
+    *v = cbor_get_int(i);
+    return h->err;
+}
+
+cft_err_t cft_set_sz(cft_context_t* h, const char* pointer, const unsigned char* v, unsigned char* old, size_t old_size) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_set_sz_p(h, p, v, old, old_size);
+}
+
+// Copy the value found by the last lookup to old, so that the caller can undo the change later.
+static cft_err_t copy_old_value(cft_context_t* h, const cbor_item_t* i, unsigned char* old, size_t old_size) {
+    if (old_size <= i->metadata.string_metadata.length) {
+        h->err = CFT_ERR_INSUFFICIENT_BUFFER;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for value (%" PRIu64 " bytes)", i->metadata.string_metadata.length);
+        return h->err;
+    }
+
+    memset(old, 0, old_size);
+    memcpy(old, i->data, i->metadata.string_metadata.length);
+    return h->err;
+}
+
+// Overwrite the value found by the last lookup with the new string if it fits in the room of the old one.
+// Returns false, without touching anything, if the CBOR data needs a rewrite instead.
+static bool set_value_in_place(cft_context_t* h, const cbor_item_t* i, const unsigned char* v, size_t new_size) {
+    if (!cbor_isa_string(i)) {
+        return false;
+    }
+
+    struct cbor_head value_head;
+    if (read_head(h, h->value_offset, &value_head) && value_head.indefinite) {
+        // The old string is padded. As long as the new one fits in its room, pad it the same way
+        // and write it over the old one.
+        unsigned char head[MAX_INIT_BYTES_LEN + 1] = {0};
+        size_t head_len = encode_slot_start(CBOR_MAJOR_STRING, new_size, head, sizeof(head));
+        if (head_len > 0 && head_len + new_size < h->value_length) {
+            // Unless the new string has the length of the old one, the chunk length and the padding both change.
+            // A crash half way through writing them would leave malformed data, so durable sets rewrite the file.
+            unsigned char old_head[MAX_INIT_BYTES_LEN + 1] = {0};
+            bool same_len = i->metadata.string_metadata.length == new_size && read_bytes(h, h->value_offset, old_head, head_len) &&
+                            memcmp(old_head, head, head_len) == 0;
+            if (!same_len && h->durability != CFT_DURABILITY_NONE) {
+                return false;
+            }
+
+            size_t tail_len = h->value_length - head_len - new_size;
+            uint8_t* tail = malloc(tail_len);
+            if (tail == NULL) {
+                h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate padding buffer");
+                return true;
+            }
+
+            memset(tail, CBOR_MAJOR_STRING << 5, tail_len - 1);
+            tail[tail_len - 1] = CBOR_BREAK;
+            struct iovec iov[3] = {{head, head_len}, {(void*)v, new_size}, {tail, tail_len}};
+            set_item_in_place(h, iov, 3);
+            free(tail);
+            return true;
+        }
+    }
+
+    unsigned char head[MAX_INIT_BYTES_LEN] = {0};
+    size_t head_len = cbor_encode_string_start(new_size, head, sizeof(head));
+    if (head_len > 0 && head_len + new_size == h->value_length) {
+        // The new string takes exactly the room of the old one, no need to rewrite the whole file.
+        struct iovec iov[2] = {{head, head_len}, {(void*)v, new_size}};
+        set_item_in_place(h, iov, 2);
+        return true;
+    }
+
+    return false;
+}
+
+cft_err_t cft_set_sz_p(cft_context_t* h, const cft_pointer_t* p, const unsigned char* v, unsigned char* old, size_t old_size) {
+    size_t new_size = strlen(v);
+    if (new_size >= h->data_size) {
+        h->err = CFT_ERR_INSUFFICIENT_BUFFER;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for value (%" PRIu64 " bytes)", new_size);
+        return h->err;
+    }
+
+    if (h->log.enabled) {
+        cbor_item_t* i = get_item(h, p);
+        if (i == NULL && h->err != CFT_ERR_POINTER_NOT_FOUND) {
+            return h->err;
+        }
+
+        if (i != NULL && old != NULL && copy_old_value(h, i, old, old_size) != CFT_ERR_OK) {
+            return h->err;
+        }
+
+        h->err = CFT_ERR_OK;
+        return append_log(h, p, v, new_size);
+    }
+
+    // A single pass finds out whether the key exists and plans the rewrite that sets or inserts it,
+    // creating the missing maps on the way. The rewrite only happens if the new value can't go in place.
+    cft_txn_t txn = {0};
+    struct txn t = {0};
+    txn.active = true;
+    if (txn_add(h, &txn, p, CFT_TXN_SET, v, new_size) == CFT_ERR_OK && plan_rewrite(h, &t, &txn)) {
+        const struct txn_edit* e = NULL;
+        for (size_t n = 0; n < t.edit_count && e == NULL; n++) {
+            e = t.edits[n].type == TXN_EDIT_VALUE ? &t.edits[n] : NULL;
+        }
+
+        if (e == NULL) {
+            log("=> Key is not present, hence new key and its value ...\n");
+            write_rewrite(h, &t);
+        } else {
+            log("=> Key already exists, hence setting to a new value ...\n");
+            h->pointer = p;
+            h->pointer_found = false;
+            cbor_item_t* i = decode_value(h, e->offset, e->len);
+            if (i != NULL && (old == NULL || copy_old_value(h, i, old, old_size) == CFT_ERR_OK) && !set_value_in_place(h, i, v, new_size)) {
+                write_rewrite(h, &t);
+            }
+        }
+    }
+
+    free_rewrite(&t);
+    free_txn(&txn);
+    return h->err;
+}
+
+cft_err_t cft_set_bytes_stream(cft_context_t* h, const char* pointer, size_t total_len, cft_read_cb_t read_cb, void* user) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_set_bytes_stream_p(h, p, total_len, read_cb, user);
+}
+
+// Set the JSON Pointer to a byte string of total_len bytes, inserting it if needed. The bytes are pulled from
+// read_cb while the CBOR data is rewritten, so the value never has to fit in memory. read_cb fills up to size
+// bytes of buf and returns how many it has filled, 0 meaning the value can't be read any further.
+cft_err_t cft_set_bytes_stream_p(cft_context_t* h, const cft_pointer_t* p, size_t total_len, cft_read_cb_t read_cb, void* user) {
+    // The log holds the values it records, so fold it into the CBOR data first
+    if (h->log.enabled && cft_compact(h) != CFT_ERR_OK) {
+        return h->err;
+    }
+
+    cft_txn_t txn = {0};
+    struct txn t = {0};
+    txn.active = true;
+    if (txn_add(h, &txn, p, CFT_TXN_SET, NULL, 0) == CFT_ERR_OK && plan_rewrite(h, &t, &txn)) {
+        t.read_cb = read_cb;
+        t.user = user;
+        t.stream_len = total_len;
+        write_rewrite(h, &t);
+    }
+
+    free_rewrite(&t);
+    free_txn(&txn);
+    return h->err;
+}
+
+cft_err_t cft_erase(cft_context_t* h, const char* pointer) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_erase_p(h, p);
+}
+
+cft_err_t cft_erase_p(cft_context_t* h, const cft_pointer_t* p) {
+    if (h->log.enabled) {
+        cbor_item_t* i = get_item(h, p);
+        if (i == NULL && h->err != CFT_ERR_POINTER_IS_MAP) {
+            return h->err;
+        }
+
+        if (p->depth == 0) {
+            h->err = CFT_ERR_POINTER_NOT_FOUND;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "cannot find '/' in the pointer \"%s\"", p->str);
+            return h->err;
+        }
+
+        h->err = CFT_ERR_OK;
+        return append_log(h, p, NULL, 0);
+    }
+
+    // A single pass finds the key and plans the rewrite that drops it, with its whole value and the maps in it,
+    // from its map. If the key doesn't exist the pass fails before anything is written.
+    return rewrite_item(h, p, CFT_TXN_ERASE, NULL, 0);
+}
+
+cft_err_t cft_txn_begin(cft_context_t* h) {
+    free_txn(&h->txn);
+    h->txn.active = true;
+    h->err = CFT_ERR_OK;
+    return h->err;
+}
+
+cft_err_t cft_txn_set_sz(cft_context_t* h, const char* pointer, const unsigned char* v) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_txn_set_sz_p(h, p, v);
+}
+
+cft_err_t cft_txn_set_sz_p(cft_context_t* h, const cft_pointer_t* p, const unsigned char* v) {
+    return txn_add(h, &h->txn, p, CFT_TXN_SET, v, strlen((const char*)v));
+}
+
+cft_err_t cft_txn_erase(cft_context_t* h, const char* pointer) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_txn_erase_p(h, p);
+}
+
+cft_err_t cft_txn_erase_p(cft_context_t* h, const cft_pointer_t* p) {
+    return txn_add(h, &h->txn, p, CFT_TXN_ERASE, NULL, 0);
+}
+
+void cft_txn_abort(cft_context_t* h) {
+    free_txn(&h->txn);
+}
+
+// Apply all the queued operations in a single rewrite of the CBOR data. The new data replaces the old one
+// in one rename, so readers see either none or all of the changes. Nothing is written if any operation
+// fails, and the transaction ends either way.
+cft_err_t cft_txn_commit(cft_context_t* h) {
+    cft_txn_t* txn = &h->txn;
+    h->err = CFT_ERR_OK;
+    if (!txn->active) {
+        h->err = CFT_ERR_NO_TRANSACTION;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "no transaction has begun");
+        return h->err;
+    }
+
+    if (txn->count == 0) {
+        free_txn(txn);
+        return h->err;
+    }
+
+    // The operations were checked against the CBOR data alone, so fold the log into it first
+    if (!h->log.enabled || cft_compact(h) == CFT_ERR_OK) {
+        rewrite_document(h, txn);
+    }
+
+    free_txn(txn);
+    return h->err;
+}
+
+cft_err_t cft_init(cft_context_t* h, const char* path) {
+    return cft_init_mode(h, path, CFT_MODE_STREAM);
+}
+
+cft_err_t cft_init_mode(cft_context_t* h, const char* path, cft_mode_t mode) {
+    if (strlen(path) >= sizeof(h->path)) {
+        h->err = CFT_ERR_INSUFFICIENT_PATH_BUFFER;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough to store path \"%s\"", path);
+        return h->err;
+    }
+
+    memset(h, 0, sizeof(cft_context_t));
+    strncpy(h->path, path, MAX_PATH_LEN);
+    h->mode = mode;
+    h->out.fd = -1;
+    h->out.size = WRITE_BUFFER_LEN;
+    h->durability = CFT_DURABILITY_DATA;
+
+    h->content_size = MAX_SCAN_BUF_LEN;
+    h->content = malloc(h->content_size);
+    if (h->content == NULL) {
+        h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate content buffer");
+        return h->err;
+    }
 
-    size_t bytes_read = 0;
-    struct cbor_decoder_result decode_result;
-    while (bytes_read < h->content_len) {
-        decode_result = cbor_stream_decode(h->content, h->content_size, &(h->enc_callbacks), h);
-        if ((h->err != CFT_ERR_OK) && (h->err != CFT_ERR_POINTER_NOT_FOUND)) {
+    h->dec_callbacks.uint8 = dec_uint8_callback;
+    h->dec_callbacks.uint16 = dec_uint16_callback;
+    h->dec_callbacks.uint32 = dec_uint32_callback;
+    h->dec_callbacks.uint64 = dec_uint64_callback;
+    h->dec_callbacks.negint8 = dec_negint8_callback;
+    h->dec_callbacks.negint16 = dec_negint16_callback;
+    h->dec_callbacks.negint32 = dec_negint32_callback;
+    h->dec_callbacks.negint64 = dec_negint64_callback;
+    h->dec_callbacks.byte_string = dec_byte_string_callback;
+    h->dec_callbacks.byte_string_start = dec_byte_string_start_callback;
+    h->dec_callbacks.string = dec_string_callback;
+    h->dec_callbacks.string_start = dec_string_start_callback;
+    h->dec_callbacks.array_start = dec_array_start_callback;
+    h->dec_callbacks.indef_array_start = dec_indef_array_start_callback;
+    h->dec_callbacks.map_start = dec_map_start_callback;
+    h->dec_callbacks.indef_map_start = dec_indef_map_start_callback;
+    h->dec_callbacks.tag = dec_tag_callback;
+    h->dec_callbacks.null = dec_null_callback;
+    h->dec_callbacks.undefined = dec_undefined_callback;
+    h->dec_callbacks.boolean = dec_boolean_callback;
+    h->dec_callbacks.float2 = dec_float2_callback;
+    h->dec_callbacks.float4 = dec_float4_callback;
+    h->dec_callbacks.float8 = dec_float8_callback;
+    h->dec_callbacks.indef_break = dec_indef_break_callback;
+
+    h->item.data = (uint8_t*)malloc(MAX_DATA_LEN);
+    if (h->item.data == NULL) {
+        h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate buffer");
+        return h->err;
+    }
+
+    h->stack_size = INIT_STACK_LEVEL;
+    h->stack = malloc(h->stack_size * sizeof(container_context_t));
+    h->key_path_size = MAX_POINTER_LEN + 1;
+    h->key_path = malloc(h->key_path_size);
+    if (h->stack == NULL || h->key_path == NULL) {
+        cft_uninit(h);
+        h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate container context stack");
+        return h->err;
+    }
+
+    if (!open_document(h)) {
+        cft_uninit(h);
+        return h->err;
+    }
+
+    h->data_size = MAX_DATA_LEN;
+    h->pointer_found = false;
+    h->stack_top = -1;
+    h->err = CFT_ERR_OK;
+    memset(h->insertion_map_pointer, 0, sizeof(h->insertion_map_pointer));
+    strncpy(h->insertion_map_pointer, ROOT_MAP_POINTER, MAX_POINTER_LEN);
+
+    return CFT_ERR_OK;
+}
+
+void cft_uninit(cft_context_t* h) {
+    close_document(h);
+    free_index(&h->index);
+    free_tree(&h->tree);
+    free_log(&h->log);
+    free_txn(&h->txn);
+    free(h->out.buf);
+    h->out.buf = NULL;
+    free(h->item.data);
+    h->item.data = NULL;
+    free(h->content);
+    h->content = NULL;
+    free(h->stack);
+    h->stack = NULL;
+    free(h->key_path);
+    h->key_path = NULL;
+}
+
+void cft_use_index(cft_context_t* h, bool enable) {
+    h->index.enabled = enable;
+    if (!enable) {
+        h->index.use_file = false;
+        free_index(&h->index);
+    }
+}
+
+// Materialize the whole CBOR data into an in-memory tree, and answer the lookups from it without any I/O.
+// Changes made by other processes are only seen by the next call. The context's own writes rebuild the tree.
+cft_err_t cft_load(cft_context_t* h) {
+    h->err = CFT_ERR_OK;
+    h->tree.enabled = true;
+    if (!open_document(h) || !build_tree(h)) {
+        h->tree.enabled = false;
+    }
+
+    return h->err;
+}
+
+void cft_unload(cft_context_t* h) {
+    h->tree.enabled = false;
+    free_tree(&h->tree);
+}
+
+void cft_use_slack(cft_context_t* h, size_t slack) {
+    h->slack = slack;
+}
+
+void cft_set_durability(cft_context_t* h, cft_durability_t durability) {
+    h->durability = durability;
+}
+
+// Set the size of the buffer rewrites collect the new CBOR data in before writing it, 0 for no buffer.
+void cft_set_write_buffer_size(cft_context_t* h, size_t size) {
+    free(h->out.buf);
+    h->out.buf = NULL;
+    h->out.size = size;
+}
+
+cft_err_t cft_use_log(cft_context_t* h, bool enable) {
+    h->err = CFT_ERR_OK;
+    if (!enable && h->log.enabled) {
+        // Only the CBOR data is read without the log, so fold the log into it first
+        if (cft_compact(h) != CFT_ERR_OK) {
+            return h->err;
+        }
+    }
+
+    h->log.enabled = enable;
+    free_log(&h->log);
+    return h->err;
+}
+
+void cft_set_compact_threshold(cft_context_t* h, size_t threshold) {
+    h->log.threshold = threshold;
+}
+
+// Tell whether a log record has to wait until the operations queued so far are written: one of them
+// replaced or erased the map above its JSON Pointer, or it sets a JSON Pointer the queue erases, which
+// is possibly a map until the erase is applied.
+static bool log_record_waits(const cft_txn_t* txn, const cft_pointer_t* p, bool erase) {
+    for (size_t n = 0; n < txn->count; n++) {
+        const cft_txn_op_t* op = &txn->ops[n];
+        const char* q = txn->pool + op->pointer_off;
+        size_t q_len = op->pointer_len;
+        if (q_len < p->len && memcmp(q, p->str, q_len) == 0 && p->str[q_len] == '/') {
+            return true;
+        }
+
+        if (!erase && op->type == CFT_TXN_ERASE && q_len == p->len && memcmp(q, p->str, q_len) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Queue the erase of the JSON Pointer. Erasing a key that is not in the CBOR data only cancels the
+// operations queued on it and below, e.g. when the log sets a new key and then erases it.
+static cft_err_t txn_add_log_erase(cft_context_t* h, cft_txn_t* txn, const cft_pointer_t* p) {
+    get_item(h, p);
+    bool missing = h->err == CFT_ERR_POINTER_NOT_FOUND || h->err == CFT_ERR_WRONG_DATA_TYPE;
+    if (h->err != CFT_ERR_OK && h->err != CFT_ERR_POINTER_IS_MAP && !missing) {
+        return h->err;
+    }
+
+    if (txn_add(h, txn, p, CFT_TXN_ERASE, NULL, 0) == CFT_ERR_OK && missing) {
+        // The erase went last, after the operations it replaced
+        txn->count--;
+    }
+
+    return h->err;
+}
+
+cft_err_t cft_compact(cft_context_t* h) {
+    h->err = CFT_ERR_OK;
+    cft_log_t* log = &h->log;
+    char path[MAX_PATH_LEN + sizeof(LOG_FILE_SUFFIX)];
+    get_log_path(h, path, sizeof(path));
+
+    // Hold the lock from reading the log until it is removed, so that no record appended meanwhile is lost
+    int fd = lock_log(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            // No change has been logged
+            free_log(log);
+            memset(&log->stat, 0, sizeof(log->stat));
+            log->loaded = true;
+            return h->err;
+        }
+
+        h->err = CFT_ERR_OPEN_FILE_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to lock log \"%s\"", path);
+        return h->err;
+    }
+
+    if (!load_log(h) || log->records == 0) {
+        close(fd);
+        return h->err;
+    }
+
+    // Replay every record in the order they were logged, queued in a transaction that is only written
+    // when a record depends on what it queued, so that a log without such records takes a single rewrite.
+    // If this fails half way, the log is kept and replaying it again later gives the same result.
+    bool enabled = log->enabled;
+    log->enabled = false;
+    cft_txn_t txn = {0};
+    txn.active = true;
+    size_t rewrites = 0;
+    struct log_record rec;
+    for (size_t offset = 0; offset < log->len && h->err == CFT_ERR_OK; offset += rec.len) {
+        parse_log_record(log->data, log->len, offset, &rec);
+
+        char str[MAX_POINTER_LEN + 1];
+        memcpy(str, log->data + rec.pointer_off, rec.pointer_len);
+        str[rec.pointer_len] = 0;
+        cft_pointer_t p;
+        if (cft_pointer_compile(&p, str) != CFT_ERR_OK) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "bad pointer \"%s\" in log", str);
             break;
         }
 
-        bytes_read += decode_result.read;
+        if (log_record_waits(&txn, &p, rec.erase)) {
+            if (rewrite_document(h, &txn) != CFT_ERR_OK) {
+                break;
+            }
+            rewrites++;
+            free_txn(&txn);
+            txn.active = true;
+        }
+
+        if (rec.erase) {
+            txn_add_log_erase(h, &txn, &p);
+            continue;
+        }
+
+        struct cbor_head head;
+        parse_head(log->data + rec.value_off, rec.value_len, &head);
+        txn_add(h, &txn, &p, CFT_TXN_SET, log->data + rec.value_off + head.len, head.value);
+    }
+
+    if (h->err == CFT_ERR_OK && txn.count > 0 && rewrite_document(h, &txn) == CFT_ERR_OK) {
+        rewrites++;
+    }
+    free_txn(&txn);
+    log->enabled = enabled;
+
+    if (h->err == CFT_ERR_OK) {
+        log("==> %" PRIu32 " records of log \"%s\" folded in %" PRIu64 " rewrites\n", log->records, path, rewrites);
+        remove(path);
+        free_log(log);
+    }
+
+    close(fd);
+    return h->err;
+}
+
+cft_err_t cft_use_index_file(cft_context_t* h, bool enable) {
+    h->index.use_file = enable;
+    cft_use_index(h, enable);
+    if (!enable) {
+        return CFT_ERR_OK;
+    }
+
+    // Load the index right away, so that even the first lookup is served from it.
+    h->err = CFT_ERR_OK;
+    if (open_document(h)) {
+        load_index(h);
+    }
+
+    return h->err;
+}
+
+cft_err_t cft_get_many(cft_context_t* h, const char* pointers[], size_t n, cft_result_t results[]) {
+    h->err = CFT_ERR_OK;
+    for (size_t i = 0; i < n; i++) {
+        results[i].err = CFT_ERR_POINTER_NOT_FOUND;
+    }
+
+    if (!open_document(h)) {
+        return h->err;
+    }
+
+    if (h->log.enabled && !load_log(h)) {
+        return h->err;
+    }
+
+    if (h->index.enabled || h->log.count > 0) {
+        // With an index every lookup is a hash probe anyway. With a log, every pointer has to be
+        // looked up in the log first.
+        for (size_t i = 0; i < n; i++) {
+            if (cft_pointer_compile(&h->compiled, pointers[i]) != CFT_ERR_OK) {
+                results[i].err = CFT_ERR_INSUFFICIENT_BUFFER;
+                continue;
+            }
+
+            void* data = results[i].item.data;
+            size_t size = results[i].data_size;
+            swap_output(h, &data, &size);
+            cbor_item_t* item = get_item(h, &h->compiled);
+            swap_output(h, &data, &size);
+
+            results[i].err = h->err;
+            if (item != NULL) {
+                results[i].item.type = item->type;
+                results[i].item.metadata = item->metadata;
+            }
+        }
+
+        h->err = CFT_ERR_OK;
+        return h->err;
+    }
+
+    struct batch b = {0};
+    b.results = results;
+    b.requests = malloc(n * sizeof(struct batch_request));
+    if (b.requests == NULL && n > 0) {
+        h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate batch requests");
+        return h->err;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strlen(pointers[i]);
+        if (len > MAX_POINTER_LEN) {
+            results[i].err = CFT_ERR_INSUFFICIENT_BUFFER;
+        } else if (pointers[i][0] == '/') {
+            b.requests[count].pointer = pointers[i];
+            b.requests[count].len = len;
+            b.requests[count].index = i;
+            b.requests[count].done = false;
+            count++;
+        }
+    }
+
+    qsort(b.requests, count, sizeof(struct batch_request), compare_pointers);
+    b.pending = count;
+
+    h->stack_top = -1;
+    struct cbor_head head;
+    size_t offset = 0;
+    char path[MAX_POINTER_LEN + 1] = {0};
+    if (!read_head(h, offset, &head) || head.major != CBOR_MAJOR_MAP) {
+        h->err = CFT_ERR_MALFORMATED_DATA;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "the root data item is not a map");
+    } else {
+        offset += head.len;
+        batch_map(h, &b, &offset, head.value, path, 0, 0, count);
+    }
+
+    // Whatever hasn't been found by the end of the pass doesn't exist,
+    // unless the pass was interrupted by malformed data.
+    if (h->err != CFT_ERR_OK) {
+        for (size_t i = 0; i < n; i++) {
+            if (results[i].err == CFT_ERR_POINTER_NOT_FOUND) {
+                results[i].err = h->err;
+            }
+        }
+    }
+
+    free(b.requests);
+    return h->err;
+}
+
+// Find the map of p in the CBOR data, and read its initial bytes at *offset. Only the keys of the maps on the
+// path are read, the values next to them are skipped.
+static bool find_map(cft_context_t* h, const cft_pointer_t* p, size_t* offset, struct cbor_head* map) {
+    if (h->index.enabled && p->depth > 0) {
+        if (!h->index.valid && !load_index(h)) {
+            return false;
+        }
+
+        cft_index_entry_t* e = find_index_entry(&h->index, p->str, p->len, p->seg_hash[p->depth - 1]);
+        if (e == NULL) {
+            h->err = CFT_ERR_POINTER_NOT_FOUND;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist\n", p->str);
+            return false;
+        }
+        *offset = e->offset;
+    } else {
+        *offset = 0;
+    }
+
+    char key[MAX_POINTER_LEN];
+    for (int depth = h->index.enabled ? p->depth : 0;; depth++) {
+        if (!read_head(h, *offset, map)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to decode data item at offset %" PRIu64, *offset);
+            return false;
+        }
+
+        if (map->major != CBOR_MAJOR_MAP) {
+            h->err = CFT_ERR_WRONG_DATA_TYPE;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%.*s\" should be a map",
+                     depth > 0 ? pointer_prefix_len(p, depth - 1) : 0, p->str);
+            return false;
+        }
+
+        if (depth == p->depth) {
+            return true;
+        }
+
+        const char* seg = p->str + p->seg_off[depth];
+        size_t seg_len = p->seg_len[depth];
+        bool found = false;
+        size_t pos = *offset + map->len;
+        for (uint64_t n = 0; n < map->value && !found; n++) {
+            struct cbor_head head;
+            if (!read_head(h, pos, &head) || head.major != CBOR_MAJOR_STRING || head.indefinite) {
+                h->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is not a string", pos);
+                return false;
+            }
+
+            found = head.value == seg_len && read_bytes(h, pos + head.len, key, seg_len) && memcmp(key, seg, seg_len) == 0;
+            pos += head.len + head.value;
+            if (!found && !skip_items(h, &pos, 1)) {
+                h->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, pos);
+                return false;
+            }
+        }
+
+        if (!found) {
+            h->err = CFT_ERR_POINTER_NOT_FOUND;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist\n", p->str);
+            return false;
+        }
+        *offset = pos;
+    }
+}
+
+cft_err_t cft_iter_open(cft_context_t* h, cft_iter_t* it, const char* pointer) {
+    const cft_pointer_t* p = compile_pointer(h, pointer);
+    if (p == NULL) {
+        return h->err;
+    }
+
+    return cft_iter_open_p(h, it, p);
+}
+
+// The children of the map of p are read one by one by cft_iter_next, in a single forward pass over the map.
+// The empty pointer is the root map. The context must not change the CBOR data while the iterator is open.
+// With the log enabled, the changes it records are overlaid on the children, and nothing is written.
+cft_err_t cft_iter_open_p(cft_context_t* h, cft_iter_t* it, const cft_pointer_t* p) {
+    memset(it, 0, offsetof(cft_iter_t, pointer));
+    h->err = CFT_ERR_OK;
+    if (p->depth == 0 && p->len > 0) {
+        h->err = CFT_ERR_POINTER_NOT_FOUND;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "cannot find '/' in the pointer \"%s\"", p->str);
+        return h->err;
+    }
+
+    if (p->depth == MAX_POINTER_DEPTH) {
+        h->err = CFT_ERR_INSUFFICIENT_BUFFER;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "pointer \"%s\" is too deep for its children", p->str);
+        return h->err;
+    }
+
+    cft_log_t* log = &h->log;
+    bool logged_map = false;
+    if (log->enabled) {
+        if (!load_log(h)) {
+            return h->err;
+        }
+
+        if (log->count > 0 && p->depth > 0) {
+            // The log decides whether the JSON Pointer is a map, in the CBOR data or not
+            if (get_item(h, p) != NULL) {
+                h->err = CFT_ERR_WRONG_DATA_TYPE;
+                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%s\" should be a map", p->str);
+                return h->err;
+            }
+
+            if (h->err != CFT_ERR_POINTER_IS_MAP) {
+                return h->err;
+            }
+            h->err = CFT_ERR_OK;
+            logged_map = true;
+        }
+    }
+
+    struct cbor_head map = {0};
+    size_t offset = 0;
+    if (!open_document(h)) {
+        return h->err;
+    }
+
+    if (!find_map(h, p, &offset, &map)) {
+        // A map the log made has no children in the CBOR data
+        if (!logged_map || (h->err != CFT_ERR_POINTER_NOT_FOUND && h->err != CFT_ERR_WRONG_DATA_TYPE)) {
+            return h->err;
+        }
+        h->err = CFT_ERR_OK;
+        map.len = 0;
+        map.value = 0;
+    }
+
+    if (log->enabled && log->count > 0) {
+        it->logged = calloc(log->count, sizeof(bool));
+        if (it->logged == NULL) {
+            h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate %" PRIu64 " log entry flags", log->count);
+            return h->err;
+        }
+    }
+
+    it->h = h;
+    it->offset = offset + map.len;
+    it->remaining = map.value;
+    it->stat = h->content_stat;
+    it->log = log->enabled;
+    it->log_stat = log->stat;
+    it->map_len = p->len;
+    memcpy(it->pointer.str, p->str, p->len);
+    memcpy(it->pointer.seg_off, p->seg_off, p->depth * sizeof(uint16_t));
+    memcpy(it->pointer.seg_len, p->seg_len, p->depth * sizeof(uint16_t));
+    it->pointer.str[p->len] = '/';
+    it->pointer.depth = p->depth + 1;
+    it->pointer.seg_off[p->depth] = p->len + 1;
+    return h->err;
+}
+
+// Describe a map or an array of the given size in h->item, without its content.
+static void set_container_item(cft_context_t* h, uint8_t major, uint64_t size) {
+    memset(&h->item.metadata, 0, sizeof(h->item.metadata));
+    if (major == CBOR_MAJOR_MAP) {
+        h->item.type = CBOR_TYPE_MAP;
+        h->item.metadata.map_metadata.type = _CBOR_METADATA_DEFINITE;
+        h->item.metadata.map_metadata.allocated = size;
+        h->item.metadata.map_metadata.end_ptr = size;
+    } else {
+        h->item.type = CBOR_TYPE_ARRAY;
+        h->item.metadata.array_metadata.type = _CBOR_METADATA_DEFINITE;
+        h->item.metadata.array_metadata.allocated = size;
+        h->item.metadata.array_metadata.end_ptr = size;
+    }
+}
+
+static bool iter_step(cft_iter_t* it, const char** key, cbor_item_t** value, bool values);
+
+// Count the children of the map of p, with the log overlaid on them.
+static bool count_children(cft_context_t* h, const cft_pointer_t* p, uint64_t* count) {
+    cft_iter_t it;
+    if (cft_iter_open_p(h, &it, p) != CFT_ERR_OK) {
+        return false;
+    }
+
+    const char* key;
+    *count = 0;
+    while (iter_step(&it, &key, NULL, false)) {
+        (*count)++;
+    }
+
+    bool ok = h->err == CFT_ERR_OK;
+    cft_iter_close(&it);
+    return ok;
+}
+
+enum iter_child {
+    ITER_CHILD_DATA,    ///< The log doesn't change the child, its value is read from the CBOR data
+    ITER_CHILD_GONE,    ///< The log erased the child
+    ITER_CHILD_LOGGED   ///< The log decides the value of the child
+};
+
+// Look the current child of the iterator up in the log. Its value is only set for ITER_CHILD_LOGGED, and only if
+// values is true: NULL with h->err set if it can't be returned.
+static enum iter_child get_logged_child(cft_iter_t* it, cbor_item_t** value, bool values) {
+    cft_context_t* h = it->h;
+    cft_log_t* log = &h->log;
+    cft_pointer_t c;
+    // A key with a '/' can't be given in a JSON Pointer, so the log can't have changed it
+    if (cft_pointer_compile(&c, it->pointer.str) != CFT_ERR_OK || c.depth != it->pointer.depth) {
+        return ITER_CHILD_DATA;
+    }
+
+    cft_log_entry_t* e = find_log_entry(log, c.str, c.len, c.seg_hash[c.depth - 1]);
+    if (e != NULL) {
+        it->logged[e - log->entries] = true;
+    }
+
+    h->pointer = &c;
+    h->pointer_found = false;
+    h->stack_top = -1;
+    cbor_item_t* item = NULL;
+    bool decided = get_logged_item(h, &item);
+    h->pointer = &it->pointer;
+    if (!decided) {
+        return ITER_CHILD_DATA;
+    }
+
+    if (h->err == CFT_ERR_POINTER_NOT_FOUND || h->err == CFT_ERR_WRONG_DATA_TYPE) {
+        h->err = CFT_ERR_OK;
+        return ITER_CHILD_GONE;
+    }
 
-        fseek(h->fd, bytes_read, SEEK_SET);
-        fread(h->content, h->content_size, 1, h->fd);
+    if (!values) {
+        h->err = CFT_ERR_OK;
+        return ITER_CHILD_LOGGED;
     }
 
-    fclose(h->fd);
-    h->fd = NULL;
+    *value = item;
+    if (h->err == CFT_ERR_POINTER_IS_MAP) {
+        // A map the log changed, its size is the number of children it is left with
+        uint64_t size;
+        h->err = CFT_ERR_OK;
+        *value = count_children(h, &c, &size) ? &h->item : NULL;
+        if (*value != NULL) {
+            set_container_item(h, CBOR_MAJOR_MAP, size);
+        }
+    }
 
-    return h->err;
+    return ITER_CHILD_LOGGED;
 }
 
+// Tell whether the log entry is a child of the map whose JSON Pointer is map.
+static bool is_logged_child(const cft_log_t* log, const cft_log_entry_t* e, const char* map, size_t map_len) {
+    const char* q = (const char*)log->data + e->pointer_off;
+    return e->pointer_len > map_len + 1 && memcmp(q, map, map_len) == 0 && q[map_len] == '/' &&
+           memchr(q + map_len + 1, '/', e->pointer_len - map_len - 1) == NULL;
+}
 
-static cft_err_t erase_item(cft_context_t* h, const char* pointer) {
-    memset(h->pointer, 0, sizeof(h->pointer));
-    strncpy(h->pointer, pointer, strlen(pointer));
-    h->stack_top = -1;
-    h->pointer_found = false;
-    h->insert = false;
-    h->set = false;
-    h->erase = true;
-    h->err = CFT_ERR_OK;
-    h->bytes_written = 0;
+// Move to the next child of the map, reading its value only if values is true.
+static bool iter_step(cft_iter_t* it, const char** key, cbor_item_t** value, bool values) {
+    cft_context_t* h = it->h;
+    if (h == NULL) {
+        return false;
+    }
 
-    // First we need to prepare a temp file for storing the new CBOR data
-    char* tmp_name = tempnam(NULL, NULL);
-    h->fdw = fopen(tmp_name, "wb");
-    if (h->fdw == NULL) {
-        h->err = CFT_ERR_CREATE_TEMP_FILE_ERROR;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open temp file \"%s\"", tmp_name);
-        free(tmp_name);
-        return h->err;
+    h->err = CFT_ERR_OK;
+    if (it->remaining == 0 && (it->logged == NULL || it->log_next >= h->log.count)) {
+        return false;
     }
 
-    h->fd = fopen(h->path, "rb");
-    if (h->fd == NULL) {
-        fclose(h->fdw);
-        h->fdw = NULL;
-        remove(tmp_name);
-        free(tmp_name);
-        h->err = CFT_ERR_OPEN_FILE_ERROR;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open path \"%s\"", h->path);
-        return h->err;
+    if (h->fd == NULL || stat_changed(&h->content_stat, &it->stat) ||
+        (it->log && (!h->log.loaded || stat_changed(&h->log.stat, &it->log_stat)))) {
+        h->err = CFT_ERR_DATA_CHANGED;
+        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "the CBOR data has changed since the iterator was opened");
+        return false;
     }
 
-    fseek(h->fd, 0, SEEK_SET);
-    fread(h->content, h->content_size, 1, h->fd);
+    cft_pointer_t* p = &it->pointer;
+    while (it->remaining > 0) {
+        struct cbor_head head;
+        size_t key_offset = it->offset;
+        if (!read_head(h, key_offset, &head) || head.major != CBOR_MAJOR_STRING || head.indefinite) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is not a string", key_offset);
+            return false;
+        }
+
+        size_t key_len = head.value;
+        bool fits = it->map_len + 1 + key_len <= MAX_POINTER_LEN;
+        if (fits && !read_bytes(h, key_offset + head.len, p->str + it->map_len + 1, key_len)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is truncated", key_offset);
+            return false;
+        }
 
-    size_t bytes_read = 0;
-    struct cbor_decoder_result decode_result;
-    while (bytes_read < h->content_len) {
-        decode_result = cbor_stream_decode(h->content, h->content_size, &(h->enc_callbacks), h);
-        if (h->err != CFT_ERR_OK) {
-            break;
+        size_t value_offset = key_offset + head.len + key_len;
+        size_t end = value_offset;
+        if (!read_head(h, value_offset, &head) || !skip_items(h, &end, 1)) {
+            h->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, value_offset);
+            return false;
         }
+        it->offset = end;
+        it->remaining--;
 
-        bytes_read += decode_result.read;
-        fseek(h->fd, bytes_read, SEEK_SET);
-        fread(h->content, h->content_size, 1, h->fd);
-    }
+        if (!fits) {
+            *key = NULL;
+            if (values) {
+                *value = NULL;
+            }
+            h->err = CFT_ERR_INSUFFICIENT_BUFFER;
+            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for the pointer of key at offset %" PRIu64, key_offset);
+            return true;
+        }
 
-    fclose(h->fd);
-    h->fd = NULL;
+        p->len = it->map_len + 1 + key_len;
+        p->str[p->len] = '\0';
+        p->seg_len[p->depth - 1] = key_len;
+        *key = p->str + it->map_len + 1;
 
-    fclose(h->fdw);
-    h->fdw = NULL;
+        enum iter_child child = it->logged != NULL ? get_logged_child(it, value, values) : ITER_CHILD_DATA;
+        if (child == ITER_CHILD_GONE) {
+            continue;
+        }
 
-    // Delete the original file and rename the temp file
-    remove(h->path);
-    rename(tmp_name, h->path);
-    free(tmp_name);
+        if (child == ITER_CHILD_LOGGED || !values) {
+            return true;
+        }
 
-    return h->err;
-}
+        if (head.major == CBOR_MAJOR_MAP || head.major == CBOR_MAJOR_ARRAY) {
+            set_container_item(h, head.major, head.value);
+            *value = &h->item;
+            return true;
+        }
 
-uint8_t cft_get_uint8(cft_context_t* h, const char* pointer) {
-    cbor_item_t* i = get_item(h, pointer);
-    if (i == NULL) {
-        return 0;
+        h->pointer = p;
+        h->pointer_found = false;
+        h->stack_top = -1;
+        *value = decode_value(h, value_offset, end - value_offset);
+        return true;
     }
 
-    if (!cbor_isa_uint(i) || cbor_int_get_width(i) != CBOR_INT_8) {
-#if ENABLE_LOG == 1
-        cbor_describe(i, stdout);
-#endif
+    // Then the children the log added, which the CBOR data doesn't have
+    cft_log_t* log = &h->log;
+    while (it->logged != NULL && it->log_next < log->count) {
+        size_t n = it->log_next++;
+        const cft_log_entry_t* e = &log->entries[n];
+        if (it->logged[n] || !is_logged_child(log, e, p->str, it->map_len)) {
+            continue;
+        }
 
-        h->err = CFT_ERR_WRONG_DATA_TYPE;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a uint8\n", h->pointer);
-        return 0;
+        memcpy(p->str + it->map_len, log->data + e->pointer_off + it->map_len, e->pointer_len - it->map_len);
+        p->len = e->pointer_len;
+        p->str[p->len] = '\0';
+        p->seg_len[p->depth - 1] = p->len - it->map_len - 1;
+        *key = p->str + it->map_len + 1;
+        if (get_logged_child(it, value, values) == ITER_CHILD_LOGGED) {
+            return true;
+        }
     }
 
-    return cbor_get_uint8(i);
+    return false;
 }
 
-uint16_t cft_get_uint16(cft_context_t* h, const char* pointer) {
-    cbor_item_t* i = get_item(h, pointer);
-    if (i == NULL) {
-        return 0;
+// Move to the next child of the map. Return false once all the children have been returned, or on an error that
+// stops the iteration, in which case h->err tells which. A child whose value can't be returned is still returned,
+// with a NULL value and h->err telling why, and a NULL key too if its JSON Pointer doesn't fit; the next call moves
+// past it.
+// Maps and arrays are returned as items of their type and size only, everything else is decoded like cft_get_* do.
+// With the log overlaid, erased children are left out, and the children only the log has come last.
+bool cft_iter_next(cft_iter_t* it, const char** key, cbor_item_t** value) {
+    return iter_step(it, key, value, true);
+}
+
+void cft_iter_close(cft_iter_t* it) {
+    if (it->h != NULL) {
+        it->h->stack_top = -1;
     }
+    free(it->logged);
+    it->logged = NULL;
+    it->h = NULL;
+    it->remaining = 0;
+}
 
-    if (!cbor_isa_uint(i) || cbor_int_get_width(i) != CBOR_INT_16) {
-#if ENABLE_LOG == 1
-        cbor_describe(i, stdout);
-#endif
+////////////////////////////////////////////////////////////////////////////////
 
-        h->err = CFT_ERR_WRONG_DATA_TYPE;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a uint16\n", h->pointer);
-        return 0;
+// A cft_doc_t holds the CBOR data of a file as it was when the document was opened. Nothing in it changes
+// afterwards, so any number of threads can look it up at once through their own cursor without locking.
+
+// Move *offset past count data items of the CBOR data held in memory.
+static bool skip_data(cbor_data data, size_t len, size_t* offset, size_t count) {
+    size_t pos = *offset;
+    while (count > 0) {
+        struct cbor_head head;
+        if (pos >= len || !parse_head(data + pos, len - pos, &head)) {
+            return false;
+        }
+
+        if (head.indefinite) {
+            struct cbor_slot slot;
+            if (parse_slot(data + pos, len - pos, &slot) != CBOR_DECODER_FINISHED) {
+                return false;
+            }
+            head.len = slot.len;
+        }
+
+        pos += head.len;
+        count--;
+        switch (head.major) {
+            case CBOR_MAJOR_BYTESTRING:
+            case CBOR_MAJOR_STRING:
+                pos += head.value;
+                break;
+            case CBOR_MAJOR_ARRAY:
+            case CBOR_MAJOR_TAG:
+                count += head.major == CBOR_MAJOR_ARRAY ? head.value : 1;
+                break;
+            case CBOR_MAJOR_MAP:
+                count += 2 * head.value;
+                break;
+        }
+
+        if (pos > len) {
+            return false;
+        }
     }
 
-    return cbor_get_uint16(i);
+    *offset = pos;
+    return true;
 }
 
-const unsigned char* cft_get_sz(cft_context_t* h, const char* pointer) {
-    cbor_item_t* i = get_item(h, pointer);
-    if (i == NULL) {
-        return 0;
+// Index every key of the document, reading its copy of the CBOR data like a mapped file. A document that can't be
+// indexed, such as one with a key too long for a JSON Pointer, is left without an index and scanned by each lookup.
+static void index_document(cft_doc_t* d) {
+    cft_context_t h = {0};
+    h.map = d->data;
+    h.content_len = d->len;
+    if (!build_index(&h)) {
+        log("==> \"%s\" not indexed: %s\n", d->path, h.err_msg);
+        return;
     }
 
-    if (!cbor_isa_string(i)) {
-#if ENABLE_LOG == 1
-        cbor_describe(i, stdout);
-#endif
+    d->index = h.index;
+}
 
-        h->err = CFT_ERR_WRONG_DATA_TYPE;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a null-terminated string\n", h->pointer);
-        return 0;
+cft_err_t cft_doc_open(cft_doc_t** doc, const char* path, cft_mode_t mode) {
+    *doc = NULL;
+    if (strlen(path) > MAX_PATH_LEN) {
+        return CFT_ERR_INSUFFICIENT_PATH_BUFFER;
     }
 
-    return cbor_string_handle(i);
+    cft_doc_t* d = calloc(1, sizeof(cft_doc_t));
+    if (d == NULL) {
+        return CFT_ERR_ALLOC_BUFFER_ERROR;
+    }
+    strcpy(d->path, path);
+    d->mode = mode;
+    d->refs = 1;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &d->stat) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(d);
+        return CFT_ERR_OPEN_FILE_ERROR;
+    }
+    d->len = (size_t)d->stat.st_size;
+
+    // The CBOR data is copied rather than mapped, even in CFT_MODE_MMAP. A value set in place is written over
+    // the file, and a private mapping would show it on every page this process never wrote to.
+    cft_err_t err = CFT_ERR_OK;
+    if (d->len == 0) {
+        err = CFT_ERR_MALFORMATED_DATA;
+    } else {
+        d->data = malloc(d->len);
+        size_t n = 0;
+        while (d->data != NULL && n < d->len) {
+            ssize_t r = pread(fd, d->data + n, d->len - n, n);
+            if (r <= 0) {
+                break;
+            }
+            n += r;
+        }
+
+        if (d->data == NULL) {
+            err = CFT_ERR_ALLOC_BUFFER_ERROR;
+        } else if (n < d->len) {
+            err = CFT_ERR_OPEN_FILE_ERROR;
+        }
+    }
+    close(fd);
+
+    // Every lookup starts at the root map, and a file caught halfway through being written is not loaded
+    struct cbor_head head;
+    size_t end = 0;
+    if (err == CFT_ERR_OK && (!parse_head(d->data, d->len, &head) || head.major != CBOR_MAJOR_MAP ||
+                              !skip_data(d->data, d->len, &end, 1))) {
+        err = CFT_ERR_MALFORMATED_DATA;
+    }
+
+    if (err != CFT_ERR_OK) {
+        cft_doc_unref(d);
+        return err;
+    }
+
+    // Built once per snapshot, so that lookups never walk the maps
+    index_document(d);
+    log("\"%s\" loaded, %" PRIu64 " bytes\n", path, d->len);
+    *doc = d;
+    return CFT_ERR_OK;
 }
 
-cft_err_t cft_set_sz(cft_context_t* h, const char* pointer, const unsigned char* v, unsigned char* old, size_t old_size) {
-    cbor_item_t* i = get_item(h, pointer);
-    if (i == NULL && h->err != CFT_ERR_POINTER_NOT_FOUND) {
-        return h->err;
+cft_doc_t* cft_doc_ref(cft_doc_t* doc) {
+    __atomic_add_fetch(&doc->refs, 1, __ATOMIC_RELAXED);
+    return doc;
+}
+
+void cft_doc_unref(cft_doc_t* doc) {
+    if (doc == NULL || __atomic_sub_fetch(&doc->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
     }
 
-    if (i != NULL) {
-        // the pointer exists, so we need to set the new value.
+    free_index(&doc->index);
+    free(doc->data);
+    free(doc);
+}
 
-        log("=> Key already exists, hence setting to a new value ...");
+void cft_cursor_init(cft_cursor_t* c, cft_doc_t* doc) {
+    memset(c, 0, sizeof(cft_cursor_t));
+    c->doc = cft_doc_ref(doc);
+}
 
-        // If user wants to know the original value, copy the old value to the provided buffer.
-        // Returning the old value is a useful feature, since user can undo the modification later.
-        if (old != NULL) {
-            if (old_size <= i->metadata.string_metadata.length) {
-                h->err = CFT_ERR_INSUFFICIENT_BUFFER;
-                snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for value (%" PRIu64 " bytes)", i->metadata.string_metadata.length);
-                return h->err;
+void cft_cursor_uninit(cft_cursor_t* c) {
+    cft_doc_unref(c->doc);
+    c->doc = NULL;
+}
+
+// Find the value of p in the document of the cursor without its index. Only the keys of the maps on the path
+// are looked at, the values next to them are skipped whole.
+static bool scan_value(cft_cursor_t* c, const cft_pointer_t* p) {
+    cbor_data data = c->doc->data;
+    size_t len = c->doc->len;
+    size_t offset = 0;
+    c->err = CFT_ERR_OK;
+
+    for (int depth = 0; depth < p->depth; depth++) {
+        struct cbor_head map;
+        if (!parse_head(data + offset, len - offset, &map)) {
+            c->err = CFT_ERR_MALFORMATED_DATA;
+            snprintf(c->err_msg, MAX_ERR_MSG_LEN, "fail to decode data item at offset %" PRIu64, offset);
+            return false;
+        }
+
+        if (map.major != CBOR_MAJOR_MAP) {
+            c->err = CFT_ERR_WRONG_DATA_TYPE;
+            snprintf(c->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%.*s\" should be a map",
+                     depth > 0 ? pointer_prefix_len(p, depth - 1) : 1, p->str);
+            return false;
+        }
+
+        const char* seg = p->str + p->seg_off[depth];
+        size_t seg_len = p->seg_len[depth];
+        bool found = false;
+        offset += map.len;
+        for (uint64_t n = 0; n < map.value && !found; n++) {
+            struct cbor_head key;
+            if (offset >= len || !parse_head(data + offset, len - offset, &key) || key.major != CBOR_MAJOR_STRING ||
+                key.indefinite || offset + key.len + key.value > len) {
+                c->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(c->err_msg, MAX_ERR_MSG_LEN, "key at offset %" PRIu64 " is not a string", offset);
+                return false;
             }
 
-            memset(old, 0, old_size);
-            memcpy(old, i->data, i->metadata.string_metadata.length);
+            found = key.value == seg_len && memcmp(data + offset + key.len, seg, seg_len) == 0;
+            offset += key.len + key.value;
+            if (!found && !skip_data(data, len, &offset, 1)) {
+                c->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(c->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, offset);
+                return false;
+            }
         }
 
-        size_t new_size = strlen(v);
-        if (new_size >= h->data_size) {
-            h->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for value (%" PRIu64 " bytes)", new_size);
-            return h->err;
+        if (!found || offset >= len) {
+            break;
         }
 
-        h->item.type = CBOR_TYPE_STRING;
-        h->item.metadata.string_metadata.type = _CBOR_METADATA_DEFINITE;
-        h->item.metadata.string_metadata.length = new_size;
-        memset(h->item.data, 0, h->data_size);
-        memcpy(h->item.data, v, new_size);
-        cft_err_t res = set_item(h, pointer);
-        if (res != CFT_ERR_OK) {
-            return h->err;
+        if (depth == p->depth - 1) {
+            size_t end = offset;
+            if (!skip_data(data, len, &end, 1)) {
+                c->err = CFT_ERR_MALFORMATED_DATA;
+                snprintf(c->err_msg, MAX_ERR_MSG_LEN, "fail to skip data item at offset %" PRIu64, offset);
+                return false;
+            }
+
+            struct cbor_head value;
+            if (parse_head(data + offset, len - offset, &value) && value.major == CBOR_MAJOR_MAP) {
+                c->err = CFT_ERR_POINTER_IS_MAP;
+                snprintf(c->err_msg, MAX_ERR_MSG_LEN, "pointer \"%s\" should not be a map", p->str);
+                return false;
+            }
+
+            c->value_offset = offset;
+            c->value_length = end - offset;
+            return true;
         }
+    }
 
-        return h->err;
+    c->err = CFT_ERR_POINTER_NOT_FOUND;
+    snprintf(c->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist\n", p->str);
+    return false;
+}
+
+// Find the value of p in the document of the cursor, with the same errors as a scan.
+static bool find_value(cft_cursor_t* c, const cft_pointer_t* p) {
+    cft_index_t* idx = &c->doc->index;
+    if (!idx->valid) {
+        return scan_value(c, p);
     }
 
-    if (h->err == CFT_ERR_POINTER_NOT_FOUND) {
-        // We should insert the key into h->insertion_map_pointer.
+    c->err = CFT_ERR_OK;
+    cft_index_entry_t* e = NULL;
+    if (p->depth > 0) {
+        e = find_index_entry(idx, p->str, p->len, p->seg_hash[p->depth - 1]);
+    }
 
-        log("=> Key is not present, hence new key and its value ...\n");
-        // the pointer exists, so we need to set the new value.
+    if (e != NULL && e->major == CBOR_MAJOR_MAP) {
+        c->err = CFT_ERR_POINTER_IS_MAP;
+        snprintf(c->err_msg, MAX_ERR_MSG_LEN, "pointer \"%s\" should not be a map", p->str);
+        return false;
+    }
 
-        // First we need to prepare a temp file for storing the new CBOR data
-        char* tmp_name = tempnam(NULL, NULL);
-        h->fdw = fopen(tmp_name, "wb");
-        if (h->fdw == NULL) {
-            h->err = CFT_ERR_CREATE_TEMP_FILE_ERROR;
-            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open temp file \"%s\"", tmp_name);
-            free(tmp_name);
-            return h->err;
-        }
+    if (e != NULL) {
+        c->value_offset = e->offset;
+        c->value_length = e->length;
+        return true;
+    }
 
-        size_t new_size = strlen(v);
-        if (new_size >= h->data_size) {
-            h->err = CFT_ERR_INSUFFICIENT_BUFFER;
-            snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for value (%" PRIu64 " bytes)", new_size);
-            fclose(h->fdw);
-            remove(tmp_name);
-            free(tmp_name);
-            return h->err;
+    // The closest parent that exists tells whether the JSON Pointer runs into a value
+    for (int depth = p->depth - 2; depth >= 0; depth--) {
+        int len = pointer_prefix_len(p, depth);
+        cft_index_entry_t* parent = find_index_entry(idx, p->str, len, p->seg_hash[depth]);
+        if (parent == NULL) {
+            continue;
         }
 
-        h->item.type = CBOR_TYPE_STRING;
-        h->item.metadata.string_metadata.type = _CBOR_METADATA_DEFINITE;
-        h->item.metadata.string_metadata.length = new_size;
-        memset(h->item.data, 0, h->data_size);
-        memcpy(h->item.data, v, new_size);
-        cft_err_t res = insert_item(h, pointer);
-        if (res != CFT_ERR_OK) {
-            log("=> func: %s, Error(%d) returned\n", __func__, res);
-            return h->err;
+        if (parent->major != CBOR_MAJOR_MAP) {
+            c->err = CFT_ERR_WRONG_DATA_TYPE;
+            snprintf(c->err_msg, MAX_ERR_MSG_LEN, "wrong data type: \"%.*s\" should be a map", len, p->str);
+            return false;
         }
+        break;
+    }
 
-        // Delete the original file and rename the temp file
-        fclose(h->fdw);
-        remove(h->path);
-        rename(tmp_name, h->path);
-        free(tmp_name);
-        return h->err;
+    c->err = CFT_ERR_POINTER_NOT_FOUND;
+    snprintf(c->err_msg, MAX_ERR_MSG_LEN, "\"%s\" doesn't exist\n", p->str);
+    return false;
+}
+
+// Locate the string or byte string value of p in the document of the cursor.
+static cft_err_t cursor_view(cft_cursor_t* c, const cft_pointer_t* p, uint8_t major, cft_view_t* view) {
+    if (!find_value(c, p)) {
+        return c->err;
     }
 
-    return h->err;
+    cbor_data data = c->doc->data + c->value_offset;
+    struct cbor_head head;
+    struct cbor_slot slot;
+    if (!parse_head(data, c->value_length, &head) || head.major != major) {
+        c->err = CFT_ERR_WRONG_DATA_TYPE;
+        snprintf(c->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a %s\n", p->str,
+                 major == CBOR_MAJOR_STRING ? "string" : "byte string");
+        return c->err;
+    }
+
+    if (!head.indefinite) {
+        view->ptr = data + head.len;
+        view->len = head.value;
+    } else if (parse_slot(data, c->value_length, &slot) == CBOR_DECODER_FINISHED) {
+        view->ptr = data + slot.head_len;
+        view->len = slot.length;
+    } else {
+        c->err = CFT_ERR_MALFORMATED_DATA;
+        snprintf(c->err_msg, MAX_ERR_MSG_LEN, "fail to decode data item at offset %" PRIu64, c->value_offset);
+    }
+
+    return c->err;
 }
 
-cft_err_t cft_erase(cft_context_t* h, const char* pointer) {
-    cbor_item_t* i = get_item(h, pointer);
-    if (i == NULL && h->err != CFT_ERR_POINTER_IS_MAP) {
-        return h->err;
+// Compile a pointer given as a string for a cursor lookup.
+static bool compile_cursor_pointer(cft_cursor_t* c, cft_pointer_t* p, const char* pointer) {
+    c->err = cft_pointer_compile(p, pointer);
+    if (c->err != CFT_ERR_OK) {
+        snprintf(c->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for pointer \"%.32s...\"", pointer);
+        return false;
     }
 
-    char* p = strrchr(pointer, '/');
-    if (p == NULL) {
-        fprintf(stderr, "Fatal error: cannot find '/' in the pointer \"%s\"\n", pointer);
-        return CFT_ERR_POINTER_NOT_FOUND;
+    return true;
+}
+
+cft_err_t cft_cursor_get_sz_view(cft_cursor_t* c, const char* pointer, cft_view_t* view) {
+    cft_pointer_t p;
+    if (!compile_cursor_pointer(c, &p, pointer)) {
+        return c->err;
     }
 
-    size_t count = p - pointer + 1;
-    memset(h->insertion_map_pointer, 0, sizeof(h->insertion_map_pointer));
-    memcpy(h->insertion_map_pointer, pointer, count);
+    return cft_cursor_get_sz_view_p(c, &p, view);
+}
+
+cft_err_t cft_cursor_get_sz_view_p(cft_cursor_t* c, const cft_pointer_t* p, cft_view_t* view) {
+    return cursor_view(c, p, CBOR_MAJOR_STRING, view);
+}
 
-    log("------------------------------> insertion_map_pointer: \"%s\"\n", h->insertion_map_pointer);
+cft_err_t cft_cursor_get_bytes_view(cft_cursor_t* c, const char* pointer, cft_view_t* view) {
+    cft_pointer_t p;
+    if (!compile_cursor_pointer(c, &p, pointer)) {
+        return c->err;
+    }
 
-    cft_err_t res = erase_item(h, pointer);
-    if (res != CFT_ERR_OK) {
-        fprintf(stderr, "Fatal error: fail to erase existing item \"%s\"\n", pointer);
-        return res;
+    return cft_cursor_get_bytes_view_p(c, &p, view);
+}
+
+cft_err_t cft_cursor_get_bytes_view_p(cft_cursor_t* c, const cft_pointer_t* p, cft_view_t* view) {
+    return cursor_view(c, p, CBOR_MAJOR_BYTESTRING, view);
+}
+
+cft_err_t cft_cursor_get_sz_into(cft_cursor_t* c, const char* pointer, char* buf, size_t size) {
+    cft_pointer_t p;
+    if (!compile_cursor_pointer(c, &p, pointer)) {
+        return c->err;
     }
 
-    return h->err;
+    return cft_cursor_get_sz_into_p(c, &p, buf, size);
 }
 
-cft_err_t cft_init(cft_context_t* h, const char* path) {
-    if (strlen(path) >= sizeof(h->path)) {
-        h->err = CFT_ERR_INSUFFICIENT_PATH_BUFFER;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough to store path \"%s\"", path);
-        return h->err;
+cft_err_t cft_cursor_get_sz_into_p(cft_cursor_t* c, const cft_pointer_t* p, char* buf, size_t size) {
+    cft_view_t view;
+    if (cursor_view(c, p, CBOR_MAJOR_STRING, &view) != CFT_ERR_OK) {
+        return c->err;
     }
 
-    memset(h, 0, sizeof(cft_context_t));
-    strncpy(h->path, path, MAX_PATH_LEN);
-    h->fd = fopen(h->path, "rb");
-    if (h->fd == NULL) {
-        h->err = CFT_ERR_OPEN_FILE_ERROR;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to open path \"%s\"", h->path);
-        return h->err;
+    if (view.len >= size) {
+        c->err = CFT_ERR_INSUFFICIENT_BUFFER;
+        snprintf(c->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for the string (%" PRIu64 " bytes)", view.len);
+        return c->err;
     }
 
-    fseek(h->fd, 0, SEEK_END);
-    h->content_len = (size_t)ftell(h->fd);
-    fclose(h->fd);
-    h->fd = NULL;
+    memcpy(buf, view.ptr, view.len);
+    buf[view.len] = '\0';
+    return c->err;
+}
 
-    h->content_size = MAX_SCAN_BUF_LEN;
-    h->content = malloc(h->content_size);
-    if (h->content == NULL) {
-        h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate content buffer");
-        return h->err;
+cft_err_t cft_cursor_get_uint(cft_cursor_t* c, const char* pointer, uint64_t* v) {
+    cft_pointer_t p;
+    if (!compile_cursor_pointer(c, &p, pointer)) {
+        return c->err;
     }
 
-    h->dec_callbacks.uint8 = dec_uint8_callback;
-    h->dec_callbacks.uint16 = dec_uint16_callback;
-    h->dec_callbacks.uint32 = dec_uint32_callback;
-    h->dec_callbacks.uint64 = dec_uint64_callback;
-    h->dec_callbacks.negint8 = dec_negint8_callback;
-    h->dec_callbacks.negint16 = dec_negint16_callback;
-    h->dec_callbacks.negint32 = dec_negint32_callback;
-    h->dec_callbacks.negint64 = dec_negint64_callback;
-    h->dec_callbacks.byte_string = dec_byte_string_callback;
-    h->dec_callbacks.byte_string_start = dec_byte_string_start_callback;
-    h->dec_callbacks.string = dec_string_callback;
-    h->dec_callbacks.string_start = dec_string_start_callback;
-    h->dec_callbacks.array_start = dec_array_start_callback;
-    h->dec_callbacks.indef_array_start = dec_indef_array_start_callback;
-    h->dec_callbacks.map_start = dec_map_start_callback;
-    h->dec_callbacks.indef_map_start = dec_indef_map_start_callback;
-    h->dec_callbacks.tag = dec_tag_callback;
-    h->dec_callbacks.null = dec_null_callback;
-    h->dec_callbacks.undefined = dec_undefined_callback;
-    h->dec_callbacks.boolean = dec_boolean_callback;
-    h->dec_callbacks.float2 = dec_float2_callback;
-    h->dec_callbacks.float4 = dec_float4_callback;
-    h->dec_callbacks.float8 = dec_float8_callback;
-    h->dec_callbacks.indef_break = dec_indef_break_callback;
+    return cft_cursor_get_uint_p(c, &p, v);
+}
 
-    h->enc_callbacks.uint8 = enc_uint8_callback;
-    h->enc_callbacks.uint16 = enc_uint16_callback;
-    h->enc_callbacks.uint32 = enc_uint32_callback;
-    h->enc_callbacks.uint64 = enc_uint64_callback;
-    h->enc_callbacks.negint8 = enc_negint8_callback;
-    h->enc_callbacks.negint16 = enc_negint16_callback;
-    h->enc_callbacks.negint32 = enc_negint32_callback;
-    h->enc_callbacks.negint64 = enc_negint64_callback;
-    h->enc_callbacks.byte_string = enc_byte_string_callback;
-    h->enc_callbacks.byte_string_start = enc_byte_string_start_callback;
-    h->enc_callbacks.string = enc_string_callback;
-    h->enc_callbacks.string_start = enc_string_start_callback;
-    h->enc_callbacks.array_start = enc_array_start_callback;
-    h->enc_callbacks.indef_array_start = enc_indef_array_start_callback;
-    h->enc_callbacks.map_start = enc_map_start_callback;
-    h->enc_callbacks.indef_map_start = enc_indef_map_start_callback;
-    h->enc_callbacks.tag = enc_tag_callback;
-    h->enc_callbacks.null = enc_null_callback;
-    h->enc_callbacks.undefined = enc_undefined_callback;
-    h->enc_callbacks.boolean = enc_boolean_callback;
-    h->enc_callbacks.float2 = enc_float2_callback;
-    h->enc_callbacks.float4 = enc_float4_callback;
-    h->enc_callbacks.float8 = enc_float8_callback;
-    h->enc_callbacks.indef_break = enc_indef_break_callback;
+cft_err_t cft_cursor_get_uint_p(cft_cursor_t* c, const cft_pointer_t* p, uint64_t* v) {
+    if (!find_value(c, p)) {
+        return c->err;
+    }
 
-    h->item.data = (uint8_t*)malloc(MAX_DATA_LEN);
-    if (h->item.data == NULL) {
-        h->err = CFT_ERR_ALLOC_BUFFER_ERROR;
-        snprintf(h->err_msg, MAX_ERR_MSG_LEN, "fail to allocate buffer");
-        return h->err;
+    struct cbor_head head;
+    if (!parse_head(c->doc->data + c->value_offset, c->value_length, &head) || head.major != CBOR_MAJOR_UINT) {
+        c->err = CFT_ERR_WRONG_DATA_TYPE;
+        snprintf(c->err_msg, MAX_ERR_MSG_LEN, "\"%s\" should be a uint\n", p->str);
+        return c->err;
     }
 
-    h->data_size = MAX_DATA_LEN;
-    h->pointer_found = false;
-    h->stack_top = -1;
-    h->err = CFT_ERR_OK;
-    memset(h->insertion_map_pointer, 0, sizeof(h->insertion_map_pointer));
-    strncpy(h->insertion_map_pointer, ROOT_MAP_POINTER, MAX_POINTER_LEN);
+    // Whatever the encoded width is
+    *v = head.value;
+    return c->err;
+}
 
-    return CFT_ERR_OK;
+////////////////////////////////////////////////////////////////////////////////
+
+// A cft_reloader_t publishes the latest snapshot of a file as a cft_doc_t. Readers take a reference to it
+// without ever waiting: they announce themselves in the counter of the current epoch while they load the
+// pointer and reference the snapshot. A reload swaps the pointer, moves on to the next epoch, and drops its
+// reference to the old snapshot once the readers of the previous epoch are done. The old snapshot itself
+// is only freed when the last reader holding it drops it.
+
+cft_err_t cft_reloader_init(cft_reloader_t* r, const char* path, cft_mode_t mode) {
+    memset(r, 0, sizeof(cft_reloader_t));
+    pthread_mutex_init(&r->lock, NULL);
+    if (strlen(path) > MAX_PATH_LEN) {
+        r->err = CFT_ERR_INSUFFICIENT_PATH_BUFFER;
+        snprintf(r->err_msg, MAX_ERR_MSG_LEN, "buffer is not large enough for path \"%.32s...\"", path);
+        return r->err;
+    }
+    strcpy(r->path, path);
+    r->mode = mode;
+
+    r->err = cft_doc_open(&r->doc, path, mode);
+    if (r->err != CFT_ERR_OK) {
+        snprintf(r->err_msg, MAX_ERR_MSG_LEN, "fail to load path \"%s\"", path);
+    }
+    return r->err;
 }
 
-void cft_uninit(cft_context_t* h) {
-    free(h->item.data);
-    free(h->content);
-}
\ No newline at end of file
+// No reader may be left when the reloader goes away, the snapshots they still hold stay valid.
+void cft_reloader_uninit(cft_reloader_t* r) {
+    cft_doc_unref(r->doc);
+    r->doc = NULL;
+    pthread_mutex_destroy(&r->lock);
+}
+
+cft_err_t cft_reloader_reload(cft_reloader_t* r) {
+    pthread_mutex_lock(&r->lock);
+    r->err = CFT_ERR_OK;
+    cft_doc_t* old = r->doc;
+    if (old != NULL && !file_changed(r->path, &old->stat)) {
+        pthread_mutex_unlock(&r->lock);
+        return r->err;
+    }
+
+    // The new snapshot is loaded before anything is published, readers keep using the old one meanwhile
+    cft_doc_t* doc;
+    r->err = cft_doc_open(&doc, r->path, r->mode);
+    if (r->err != CFT_ERR_OK) {
+        snprintf(r->err_msg, MAX_ERR_MSG_LEN, "fail to reload path \"%s\", keeping the previous snapshot", r->path);
+        pthread_mutex_unlock(&r->lock);
+        return r->err;
+    }
+
+    log("\"%s\" has changed, publishing a new snapshot\n", r->path);
+    __atomic_store_n(&r->doc, doc, __ATOMIC_SEQ_CST);
+
+    // Readers counted in the previous epoch may have loaded the old pointer without referencing it yet
+    unsigned epoch = __atomic_fetch_add(&r->epoch, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&r->readers[epoch & 1], __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+
+    cft_doc_unref(old);
+    pthread_mutex_unlock(&r->lock);
+    return r->err;
+}
+
+cft_doc_t* cft_reloader_acquire(cft_reloader_t* r) {
+    unsigned epoch;
+    for (;;) {
+        epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&r->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+
+        // A reload that moved on in between may not wait for this counter, so count again in the new epoch
+        if (__atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST) == epoch) {
+            break;
+        }
+        __atomic_sub_fetch(&r->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+
+    cft_doc_t* doc = cft_doc_ref(__atomic_load_n(&r->doc, __ATOMIC_SEQ_CST));
+    __atomic_sub_fetch(&r->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    return doc;
+}
+
+// Move the cursor to the latest snapshot. This is a single load when it is already there.
+void cft_cursor_refresh(cft_cursor_t* c, cft_reloader_t* r) {
+    if (__atomic_load_n(&r->doc, __ATOMIC_ACQUIRE) == c->doc) {
+        return;
+    }
+
+    cft_doc_t* doc = cft_reloader_acquire(r);
+    cft_doc_unref(c->doc);
+    c->doc = doc;
+}
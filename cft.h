@@ -3,16 +3,22 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "cbor.h"
 
-#define MAX_LEVEL          16
+#define INIT_STACK_LEVEL   16
 #define MAX_POINTER_LEN    256
+#define MAX_POINTER_DEPTH  64
 #define MAX_ERR_MSG_LEN    128
 #define MAX_DATA_LEN       1024
 #define MAX_SCAN_BUF_LEN   1024
 #define MAX_INIT_BYTES_LEN 8
 #define MAX_PATH_LEN       256
+#define WRITE_BUFFER_LEN   65536
+#define INDEX_FILE_SUFFIX  ".cftidx"
+#define LOG_FILE_SUFFIX    ".cftlog"
 #define ENABLE_LOG         1
 #define ROOT_MAP_POINTER "/"
 
@@ -28,49 +34,309 @@ typedef enum cft_err {
     CFT_ERR_MALFORMATED_DATA,
     CFT_ERR_POINTER_IS_MAP,
     CFT_ERR_CREATE_TEMP_FILE_ERROR,
-    CFT_ERR_OPEN_FILE_ERROR
+    CFT_ERR_OPEN_FILE_ERROR,
+    CFT_ERR_MAP_FILE_ERROR,
+    CFT_ERR_WRITE_FILE_ERROR,
+    CFT_ERR_NO_TRANSACTION,
+    CFT_ERR_READ_STREAM_ERROR,
+    CFT_ERR_DATA_CHANGED
 } cft_err_t;
 
+typedef enum cft_mode {
+    CFT_MODE_STREAM,  ///< Read the CBOR data through a MAX_SCAN_BUF_LEN buffer
+    CFT_MODE_MMAP     ///< Map the whole CBOR data file and decode it in place
+} cft_mode_t;
+
+typedef enum cft_durability {
+    CFT_DURABILITY_NONE,  ///< Leave writing the changes to the storage to the system, a crash may lose them
+    CFT_DURABILITY_DATA,  ///< Sync the new data before it replaces the old one, a crash leaves either of them
+    CFT_DURABILITY_FULL   ///< Sync the directory too, a change survives any crash once it has returned
+} cft_durability_t;
+
+typedef struct cft_pointer {
+    char str[MAX_POINTER_LEN + 1];          ///< JSON Pointer
+    size_t len;                             ///< Length of the JSON Pointer
+    int depth;                              ///< Number of segments, 0 if the pointer doesn't start with '/'
+    uint16_t seg_off[MAX_POINTER_DEPTH];    ///< Offset of each segment in str
+    uint16_t seg_len[MAX_POINTER_DEPTH];    ///< Length of each segment
+    uint32_t seg_hash[MAX_POINTER_DEPTH];   ///< Index hash of the JSON Pointer up to the end of each segment
+} cft_pointer_t;
+
 typedef struct container_context {
     cbor_type type;
     size_t size;
     int current_index;
-    char key[MAX_POINTER_LEN + 1];
+    bool has_key;                           ///< Indicate whether the key of the current entry has been seen
     bool keep_searching;
     bool should_ignore;
-    char map_pointer[MAX_POINTER_LEN + 1];
+    bool on_path;                           ///< Indicate whether the map itself is a prefix of the pointer
+    int depth;                              ///< Index of the pointer segment the keys of this map are compared with
+    size_t path_len;                        ///< Length of the map pointer (with its trailing '/') in key_path
+    size_t key_len;                         ///< Length of the current key, stored in key_path right after the map pointer
 } container_context_t;
 
+typedef struct cft_index_entry {
+    uint32_t hash;         ///< Hash of the JSON Pointer
+    uint32_t pointer_off;  ///< Offset of the JSON Pointer in the name pool
+    uint32_t pointer_len;  ///< Length of the JSON Pointer
+    uint32_t major;        ///< CBOR major type of the value
+    uint64_t offset;       ///< Offset of the value in the CBOR data
+    uint64_t length;       ///< Encoded length of the value, including its initial bytes
+} cft_index_entry_t;
+
+typedef struct cft_index {
+    bool enabled;                ///< Indicate whether lookups should go through the index
+    bool valid;                  ///< Indicate whether the index matches the open CBOR data
+    cft_index_entry_t* entries;  ///< One entry per key in the CBOR data
+    size_t count;                ///< Number of entries
+    size_t capacity;             ///< Number of allocated entries
+    uint32_t* slots;             ///< Open addressing hash table of entry index + 1 (0 means empty)
+    size_t slot_count;           ///< Number of slots, always a power of 2
+    char* names;                 ///< Name pool holding the JSON Pointers of all entries
+    size_t names_len;            ///< Used bytes in the name pool
+    size_t names_size;           ///< Size of the name pool
+    bool use_file;               ///< Indicate whether the index is persisted next to the CBOR data
+    void* file_map;              ///< Mapped index file the arrays above point into, if loaded from disk
+    size_t file_map_len;         ///< Length of the mapped index file
+} cft_index_t;
+
+typedef struct cft_tree {
+    bool enabled;        ///< Indicate whether lookups should go through the in-memory tree
+    bool valid;          ///< Indicate whether the tree matches the open CBOR data
+    void* arena;         ///< Single allocation holding the node arrays, followed by the data they refer to
+    size_t node_count;   ///< Number of nodes, the root map first and the children of each map contiguous
+    uint64_t* value;     ///< Per node: inline scalar, offset of the encoded value in data, or first child of a map
+    uint32_t* key_hash;  ///< Per node: hash of the key, the children of each map are sorted by it
+    uint32_t* key_off;   ///< Per node: offset of the key in data
+    uint32_t* key_len;   ///< Per node: length of the key
+    uint32_t* count;     ///< Per node: number of children of a map, or length of the encoded value in data
+    uint8_t* type;       ///< Per node: how the value is stored
+    uint8_t* data;       ///< Keys and encoded values of the nodes
+    size_t data_len;     ///< Used bytes in data
+} cft_tree_t;
+
+typedef struct cft_log_entry {
+    uint32_t hash;          ///< Hash of the JSON Pointer
+    uint32_t seq;           ///< Sequence number of the latest record on the JSON Pointer itself, 0 if none
+    uint32_t map_seq;       ///< Sequence number of the latest record on a JSON Pointer below it, 0 if none
+    bool erase;             ///< Indicate whether the latest record on the JSON Pointer erases it
+    size_t pointer_off;     ///< Offset of the JSON Pointer in the log
+    size_t pointer_len;     ///< Length of the JSON Pointer
+    size_t value_off;       ///< Offset of the value of the latest record in the log
+    size_t value_len;       ///< Encoded length of the value of the latest record
+} cft_log_entry_t;
+
+typedef struct cft_log {
+    bool enabled;                ///< Indicate whether changes are appended to the log instead of rewriting the CBOR data
+    bool loaded;                 ///< Indicate whether the log below matches the log file
+    uint8_t* data;               ///< Content of the log file
+    size_t len;                  ///< Length of the valid records in data
+    size_t size;                 ///< Size of the data buffer
+    uint32_t records;            ///< Number of records in the log
+    cft_log_entry_t* entries;    ///< One entry per JSON Pointer touched by the log, or above one
+    size_t count;                ///< Number of entries
+    size_t capacity;             ///< Number of allocated entries
+    uint32_t* slots;             ///< Open addressing hash table of entry index + 1 (0 means empty)
+    size_t slot_count;           ///< Number of slots, always a power of 2
+    size_t threshold;            ///< Log length from which a change folds the log into the CBOR data, 0 for never
+    struct stat stat;            ///< File status of the log file when it was read, used to detect changes
+} cft_log_t;
+
+typedef enum cft_txn_op_type {
+    CFT_TXN_SET,   ///< Set the JSON Pointer to a string, inserting it if needed
+    CFT_TXN_ERASE  ///< Erase the JSON Pointer
+} cft_txn_op_type_t;
+
+typedef struct cft_txn_op {
+    cft_txn_op_type_t type;  ///< What to do with the JSON Pointer
+    size_t pointer_off;      ///< Offset of the JSON Pointer in the pool
+    size_t pointer_len;      ///< Length of the JSON Pointer
+    size_t value_off;        ///< Offset of the new value in the pool (CFT_TXN_SET only)
+    size_t value_len;        ///< Length of the new value
+} cft_txn_op_t;
+
+typedef struct cft_txn {
+    bool active;             ///< Indicate whether a transaction has begun
+    cft_txn_op_t* ops;       ///< Pending operations, at most one per JSON Pointer
+    size_t count;            ///< Number of pending operations
+    size_t capacity;         ///< Number of allocated operations
+    char* pool;              ///< Pool holding the JSON Pointers and values of the operations
+    size_t pool_len;         ///< Used bytes in the pool
+    size_t pool_size;        ///< Size of the pool
+} cft_txn_t;
+
+typedef struct cft_writer {
+    int fd;                  ///< File the new CBOR data goes to, -1 when no rewrite is in progress
+    uint8_t* buf;            ///< Buffer holding the data not written to the file yet
+    size_t size;             ///< Size of the buffer, 0 to write everything straight to the file
+    size_t len;              ///< Number of bytes waiting in the buffer
+    size_t bytes_written;    ///< Bytes of new CBOR data produced by the last rewrite
+    size_t bytes_flushed;    ///< Bytes the last rewrite wrote to the file from the buffer or around it
+    size_t flush_count;      ///< Number of write calls the last rewrite made
+    size_t bytes_copied;     ///< Bytes the last rewrite had the kernel copy from the old data file
+} cft_writer_t;
+
+typedef struct cft_result {
+    cft_err_t err;      ///< Error code for this pointer
+    cbor_item_t item;   ///< Value found. item.data must point to a buffer provided by the caller
+    size_t data_size;   ///< Size of the buffer pointed by item.data
+} cft_result_t;
+
+typedef size_t (*cft_read_cb_t)(void* user, uint8_t* buf, size_t size);
+
+typedef struct cft_view {
+    const uint8_t* ptr;  ///< First byte of the value, inside the CBOR data held by the context
+    size_t len;          ///< Length of the value in bytes
+} cft_view_t;
+
+typedef struct cft_doc {
+    int refs;                     ///< Number of references, the document is freed when the last one is dropped
+    uint8_t* data;                ///< Private copy of the CBOR data, never modified, even when the file is written in place
+    size_t len;                   ///< Length of the CBOR data
+    cft_mode_t mode;              ///< Mode given to cft_doc_open, the CBOR data is copied in either mode
+    struct stat stat;             ///< File status of the CBOR data when it was loaded
+    cft_index_t index;            ///< Index of every key built when the document is loaded, invalid if it couldn't be
+    char path[MAX_PATH_LEN + 1];  ///< CBOR data file path
+} cft_doc_t;
+
+typedef struct cft_cursor {
+    cft_err_t err;                      ///< Error code of the last lookup
+    char err_msg[MAX_ERR_MSG_LEN + 1];  ///< Error message of the last lookup
+    cft_doc_t* doc;                     ///< Document looked up, referenced by the cursor
+    size_t value_offset;                ///< Offset of the value found in the CBOR data
+    size_t value_length;                ///< Encoded length of the value found, including its initial bytes
+} cft_cursor_t;
+
+typedef struct cft_reloader {
+    cft_err_t err;                      ///< Error code of the last reload
+    char err_msg[MAX_ERR_MSG_LEN + 1];  ///< Error message of the last reload
+    cft_doc_t* doc;                     ///< Current snapshot of the CBOR data, replaced atomically by reloads
+    unsigned epoch;                     ///< Reload epoch, its parity tells readers which counter to use
+    int readers[2];                     ///< Number of readers taking a reference to the snapshot, per epoch parity
+    pthread_mutex_t lock;               ///< Serializes the reloads, readers never take it
+    cft_mode_t mode;                    ///< How the snapshots are loaded
+    char path[MAX_PATH_LEN + 1];        ///< CBOR data file path
+} cft_reloader_t;
+
 typedef struct cft_context {
     cft_err_t err;                                    ///< Error code
     char err_msg[MAX_ERR_MSG_LEN + 1];                ///< Error message
     cbor_item_t item;                                 ///< CBOR item found
     size_t data_size;                                 ///< Size of the buffer used to hold the value
-    char pointer[MAX_POINTER_LEN + 1];                ///< JSON Pointer of the key we want to search
+    const cft_pointer_t* pointer;                     ///< JSON Pointer of the key we want to search
+    cft_pointer_t compiled;                           ///< Storage for the pointers given as strings
     bool pointer_found;                               ///< Indicate whether the key is found or not
+    size_t value_offset;                              ///< Offset of the value found in the CBOR data
+    size_t value_length;                              ///< Encoded length of the value found, including its initial bytes
     char insertion_map_pointer[MAX_POINTER_LEN + 1];  ///< JSON Pointer of the map where we can insert the key
-    container_context_t stack[MAX_LEVEL];             ///< Stack of the container context
+    int insertion_depth;                              ///< Depth of the map where we can insert the key (0 for the root)
+    container_context_t* stack;                       ///< Stack of the container context, grown as deep as the CBOR data
+    int stack_size;                                   ///< Number of allocated container contexts
     int stack_top;                                    ///< Top of the container context stack
+    char* key_path;                                   ///< JSON Pointer of the current key, shared by all the levels of the stack
+    size_t key_path_size;                             ///< Size of the key_path buffer
     struct cbor_callbacks dec_callbacks;              ///< Callbacks for decoding
-    struct cbor_callbacks enc_callbacks;              ///< Callbacks for encoding
     uint8_t* content;                                 ///< Buffer for holding partial CBOR data
     size_t content_size;                              ///< Size of the buffer holding partial CBOR data
     size_t content_len;                               ///< Total length of the CBOR data
+    size_t content_offset;                            ///< Offset of the CBOR data held in the content buffer
+    size_t content_avail;                             ///< Number of valid bytes in the content buffer
+    struct stat content_stat;                         ///< File status of the open CBOR data, used to detect changes
+    cft_mode_t mode;                                  ///< How the CBOR data is read
+    uint8_t* map;                                     ///< Mapped CBOR data (CFT_MODE_MMAP only)
     FILE* fd;                                         ///< CBOR data file descriptor for reading data
-    FILE* fdw;                                        ///< CBOR data file descriptor for writing data
-    size_t bytes_written;                             ///< Bytes that have been written to fdw
+    cft_writer_t out;                                 ///< Writer of the new CBOR data during rewrites
+    cft_durability_t durability;                      ///< How far changes are synced before they return
     char path[MAX_PATH_LEN + 1];                      ///< CBOR data file path
-    bool insert;                                      ///< Indicate whether we need to insert the pointer
-    bool set;                                         ///< Indicate whether we need to set existing pointer to new value
-    bool erase;                                       ///< Indicate whether we need to erase the pointer
+    bool skip_value;                                  ///< Indicate whether the decode loop should jump over the coming items
+    size_t skip_count;                                ///< Number of data items to jump over
+    bool view;                                        ///< Indicate whether strings and byte strings are located instead of copied
+    cbor_data view_data;                              ///< Start of the string or byte string found, when view is set
+    size_t slack;                                     ///< Padding reserved after the string values written by cft_set_sz, a new length reuses it in place under CFT_DURABILITY_NONE only
+    cft_index_t index;                                ///< Optional JSON Pointer to value offset index
+    cft_tree_t tree;                                  ///< Optional in-memory tree of the whole CBOR data
+    cft_log_t log;                                    ///< Optional log of the changes not folded into the CBOR data yet
+    cft_txn_t txn;                                    ///< Changes waiting for cft_txn_commit
 } cft_context_t;
 
+typedef struct cft_iter {
+    cft_context_t* h;       ///< Context the map is read through
+    size_t offset;          ///< Offset of the next key in the CBOR data
+    uint64_t remaining;     ///< Number of children in the CBOR data not read yet
+    struct stat stat;       ///< File status of the CBOR data when the iterator was opened
+    size_t map_len;         ///< Length of the JSON Pointer of the map
+    bool log;               ///< Indicate whether the log was enabled when the iterator was opened
+    struct stat log_stat;   ///< File status of the log when the iterator was opened
+    bool* logged;           ///< Log entries already dealt with, NULL if the log had no records
+    size_t log_next;        ///< Next log entry to look at for the children found in the log only
+    cft_pointer_t pointer;  ///< JSON Pointer of the current child, whose key is the last segment
+} cft_iter_t;
+
 cft_err_t cft_init(cft_context_t* h, const char* path);
+cft_err_t cft_init_mode(cft_context_t* h, const char* path, cft_mode_t mode);
 void cft_uninit(cft_context_t* h);
+void cft_use_index(cft_context_t* h, bool enable);
+cft_err_t cft_use_index_file(cft_context_t* h, bool enable);
+cft_err_t cft_load(cft_context_t* h);
+void cft_unload(cft_context_t* h);
+void cft_use_slack(cft_context_t* h, size_t slack);
+void cft_set_write_buffer_size(cft_context_t* h, size_t size);
+void cft_set_durability(cft_context_t* h, cft_durability_t durability);
+cft_err_t cft_use_log(cft_context_t* h, bool enable);
+void cft_set_compact_threshold(cft_context_t* h, size_t threshold);
+cft_err_t cft_compact(cft_context_t* h);
+cft_err_t cft_txn_begin(cft_context_t* h);
+cft_err_t cft_txn_set_sz(cft_context_t* h, const char* pointer, const unsigned char* v);
+cft_err_t cft_txn_set_sz_p(cft_context_t* h, const cft_pointer_t* p, const unsigned char* v);
+cft_err_t cft_txn_erase(cft_context_t* h, const char* pointer);
+cft_err_t cft_txn_erase_p(cft_context_t* h, const cft_pointer_t* p);
+cft_err_t cft_txn_commit(cft_context_t* h);
+void cft_txn_abort(cft_context_t* h);
 uint8_t cft_get_uint8(cft_context_t* h, const char* pointer);
 uint16_t cft_get_uint16(cft_context_t* h, const char* pointer);
 const unsigned char* cft_get_sz(cft_context_t* h, const char* pointer);
 cft_err_t cft_set_sz(cft_context_t* h, const char* pointer, const unsigned char* v, unsigned char* old, size_t old_size);
+cft_err_t cft_set_bytes_stream(cft_context_t* h, const char* pointer, size_t total_len, cft_read_cb_t read_cb, void* user);
 cft_err_t cft_erase(cft_context_t* h, const char* pointer);
+cft_err_t cft_pointer_compile(cft_pointer_t* p, const char* pointer);
+uint8_t cft_get_uint8_p(cft_context_t* h, const cft_pointer_t* p);
+uint16_t cft_get_uint16_p(cft_context_t* h, const cft_pointer_t* p);
+const unsigned char* cft_get_sz_p(cft_context_t* h, const cft_pointer_t* p);
+cft_err_t cft_get_sz_into(cft_context_t* h, const char* pointer, char* buf, size_t size);
+cft_err_t cft_get_sz_into_p(cft_context_t* h, const cft_pointer_t* p, char* buf, size_t size);
+cft_err_t cft_get_bytes_into(cft_context_t* h, const char* pointer, uint8_t* buf, size_t size, size_t* len);
+cft_err_t cft_get_bytes_into_p(cft_context_t* h, const cft_pointer_t* p, uint8_t* buf, size_t size, size_t* len);
+cft_err_t cft_get_uint(cft_context_t* h, const char* pointer, uint64_t* v);
+cft_err_t cft_get_sz_view(cft_context_t* h, const char* pointer, cft_view_t* view);
+cft_err_t cft_get_sz_view_p(cft_context_t* h, const cft_pointer_t* p, cft_view_t* view);
+cft_err_t cft_get_bytes_view(cft_context_t* h, const char* pointer, cft_view_t* view);
+cft_err_t cft_get_bytes_view_p(cft_context_t* h, const cft_pointer_t* p, cft_view_t* view);
+cft_err_t cft_get_uint_p(cft_context_t* h, const cft_pointer_t* p, uint64_t* v);
+cft_err_t cft_set_sz_p(cft_context_t* h, const cft_pointer_t* p, const unsigned char* v, unsigned char* old, size_t old_size);
+cft_err_t cft_set_bytes_stream_p(cft_context_t* h, const cft_pointer_t* p, size_t total_len, cft_read_cb_t read_cb, void* user);
+cft_err_t cft_erase_p(cft_context_t* h, const cft_pointer_t* p);
+cft_err_t cft_get_many(cft_context_t* h, const char* pointers[], size_t n, cft_result_t results[]);
+cft_err_t cft_iter_open(cft_context_t* h, cft_iter_t* it, const char* pointer);
+cft_err_t cft_iter_open_p(cft_context_t* h, cft_iter_t* it, const cft_pointer_t* p);
+bool cft_iter_next(cft_iter_t* it, const char** key, cbor_item_t** value);
+void cft_iter_close(cft_iter_t* it);
+cft_err_t cft_doc_open(cft_doc_t** doc, const char* path, cft_mode_t mode);
+cft_doc_t* cft_doc_ref(cft_doc_t* doc);
+void cft_doc_unref(cft_doc_t* doc);
+void cft_cursor_init(cft_cursor_t* c, cft_doc_t* doc);
+void cft_cursor_uninit(cft_cursor_t* c);
+cft_err_t cft_cursor_get_sz_view(cft_cursor_t* c, const char* pointer, cft_view_t* view);
+cft_err_t cft_cursor_get_sz_view_p(cft_cursor_t* c, const cft_pointer_t* p, cft_view_t* view);
+cft_err_t cft_cursor_get_bytes_view(cft_cursor_t* c, const char* pointer, cft_view_t* view);
+cft_err_t cft_cursor_get_bytes_view_p(cft_cursor_t* c, const cft_pointer_t* p, cft_view_t* view);
+cft_err_t cft_cursor_get_sz_into(cft_cursor_t* c, const char* pointer, char* buf, size_t size);
+cft_err_t cft_cursor_get_sz_into_p(cft_cursor_t* c, const cft_pointer_t* p, char* buf, size_t size);
+cft_err_t cft_cursor_get_uint(cft_cursor_t* c, const char* pointer, uint64_t* v);
+cft_err_t cft_cursor_get_uint_p(cft_cursor_t* c, const cft_pointer_t* p, uint64_t* v);
+cft_err_t cft_reloader_init(cft_reloader_t* r, const char* path, cft_mode_t mode);
+void cft_reloader_uninit(cft_reloader_t* r);
+cft_err_t cft_reloader_reload(cft_reloader_t* r);
+cft_doc_t* cft_reloader_acquire(cft_reloader_t* r);
+void cft_cursor_refresh(cft_cursor_t* c, cft_reloader_t* r);
 
 #endif
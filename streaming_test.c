@@ -0,0 +1,789 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cft.h"
+
+#define READERS 4
+#define RELOADS 200
+#define BATCH 4
+#define STREAM_LEN (64 * MAX_DATA_LEN + 5)
+#define WIDE_KEYS 300
+
+static int failures = 0;
+
+#define expect(cond)                                                  \
+    do {                                                              \
+        if (!(cond)) {                                                \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+            failures++;                                               \
+        }                                                             \
+    } while (0)
+
+// {"a": {"b": "x"}, "c": "hi"}
+static const unsigned char sample[] = {0xa2, 0x61, 'a', 0xa1, 0x61, 'b', 0x61, 'x', 0x61, 'c', 0x62, 'h', 'i'};
+
+// {"m": {"c": "in", "d": {"c": "deep"}}, "l": [{"c": "x"}, "y"], "c": "hi"}
+static const unsigned char nested[] = {0xa3, 0x61, 'm', 0xa2, 0x61, 'c', 0x62, 'i', 'n', 0x61, 'd', 0xa1, 0x61, 'c',
+                                       0x64, 'd', 'e', 'e', 'p', 0x61, 'l', 0x82, 0xa1, 0x61, 'c', 0x61, 'x', 0x61, 'y',
+                                       0x61, 'c', 0x62, 'h', 'i'};
+
+// {"s": "text", "b": h'000102', "u": 300}
+static const unsigned char scalars[] = {0xa3, 0x61, 's', 0x64, 't', 'e', 'x', 't', 0x61, 'b', 0x43, 0x00, 0x01, 0x02,
+                                        0x61, 'u', 0x19, 0x01, 0x2c};
+
+static bool write_data(const char* path, const unsigned char* data, size_t len) {
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        printf("error: fail to create \"%s\"\n", path);
+        return false;
+    }
+
+    bool ok = fwrite(data, len, 1, fp) == 1;
+    return fclose(fp) == 0 && ok;
+}
+
+static bool write_sample(const char* path) {
+    return write_data(path, sample, sizeof(sample));
+}
+
+static bool has_sz(cft_context_t* h, const char* pointer, const char* value) {
+    const unsigned char* v = cft_get_sz(h, pointer);
+    return h->err == CFT_ERR_OK && v != NULL && strcmp((const char*)v, value) == 0;
+}
+
+static bool is_missing(cft_context_t* h, const char* pointer) {
+    cft_get_sz(h, pointer);
+    return h->err == CFT_ERR_POINTER_NOT_FOUND;
+}
+
+// Keys of the maps and arrays off the path are skipped whole, even when they match a segment of the pointer.
+static void test_skip(const char* path) {
+    if (!write_data(path, nested, sizeof(nested))) {
+        failures++;
+        return;
+    }
+
+    cft_mode_t modes[] = {CFT_MODE_STREAM, CFT_MODE_MMAP};
+    for (size_t n = 0; n < sizeof(modes) / sizeof(modes[0]); n++) {
+        cft_context_t h = {0};
+        expect(cft_init_mode(&h, path, modes[n]) == CFT_ERR_OK);
+        expect(has_sz(&h, "/c", "hi"));
+        expect(has_sz(&h, "/m/c", "in"));
+        expect(has_sz(&h, "/m/d/c", "deep"));
+        expect(is_missing(&h, "/m/x"));
+        expect(is_missing(&h, "/d/c"));
+        cft_uninit(&h);
+    }
+}
+
+// Lookups through the index give what a scan gives, and follow the context's own changes.
+static void test_index(const char* path) {
+    if (!write_data(path, nested, sizeof(nested))) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    cft_use_index(&h, true);
+    expect(has_sz(&h, "/m/d/c", "deep"));
+    expect(h.index.valid);
+    expect(has_sz(&h, "/c", "hi"));
+    expect(is_missing(&h, "/m/x"));
+    cft_get_sz(&h, "/m");
+    expect(h.err == CFT_ERR_POINTER_IS_MAP);
+    cft_get_sz(&h, "/c/x");
+    expect(h.err == CFT_ERR_WRONG_DATA_TYPE);
+
+    expect(cft_set_sz(&h, "/m/c", (const unsigned char*)"changed", NULL, 0) == CFT_ERR_OK);
+    expect(cft_erase(&h, "/m/d") == CFT_ERR_OK);
+    expect(has_sz(&h, "/m/c", "changed"));
+    expect(is_missing(&h, "/m/d/c"));
+    expect(has_sz(&h, "/c", "hi"));
+    cft_uninit(&h);
+}
+
+// The index file is reused by the next context, and rebuilt once the CBOR data it was built from has changed.
+static void test_index_file(const char* path) {
+    char index_path[MAX_PATH_LEN + sizeof(INDEX_FILE_SUFFIX)];
+    snprintf(index_path, sizeof(index_path), "%s%s", path, INDEX_FILE_SUFFIX);
+    remove(index_path);
+    if (!write_data(path, nested, sizeof(nested))) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    struct stat st;
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    expect(cft_use_index_file(&h, true) == CFT_ERR_OK);
+    expect(stat(index_path, &st) == 0);
+    cft_uninit(&h);
+
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    expect(cft_use_index_file(&h, true) == CFT_ERR_OK);
+    expect(h.index.file_map != NULL);
+    expect(has_sz(&h, "/m/d/c", "deep"));
+    expect(has_sz(&h, "/c", "hi"));
+    cft_uninit(&h);
+
+    // Another document of the same length
+    unsigned char other[sizeof(nested)];
+    memcpy(other, nested, sizeof(nested));
+    other[sizeof(other) - 4] = 'e';
+    expect(write_data(path, other, sizeof(other)));
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    expect(cft_use_index_file(&h, true) == CFT_ERR_OK);
+    expect(has_sz(&h, "/e", "hi"));
+    expect(is_missing(&h, "/c"));
+    cft_uninit(&h);
+    remove(index_path);
+}
+
+// {"dup": "1", "m": {"k": "v"}, "dup": "2"}
+static const unsigned char duplicated[] = {0xa3, 0x63, 'd', 'u', 'p', 0x61, '1', 0x61, 'm', 0xa1, 0x61, 'k',
+                                           0x61, 'v', 0x63, 'd', 'u', 'p', 0x61, '2'};
+
+// {"m": {"k": "v"}, "x": <reserved initial byte>}, only valid up to the end of "m"
+static const unsigned char truncated[] = {0xa2, 0x61, 'm', 0xa1, 0x61, 'k', 0x61, 'v', 0x61, 'x', 0x1c};
+
+// A batch gives what single lookups give. A key repeated in the data is the first one, like a scan, and
+// a key missing from a map that has been read whole doesn't keep the walk going to the end of the data.
+static void test_get_many(const char* path) {
+    cft_result_t results[BATCH];
+    char values[BATCH][32];
+    for (int n = 0; n < BATCH; n++) {
+        results[n].item.data = (unsigned char*)values[n];
+        results[n].data_size = sizeof(values[n]);
+    }
+
+    if (!write_data(path, nested, sizeof(nested))) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    const char* pointers[BATCH] = {"/c", "/m/d/c", "/m/x", "/m"};
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    expect(cft_get_many(&h, pointers, BATCH, results) == CFT_ERR_OK);
+    expect(results[0].err == CFT_ERR_OK && strcmp(values[0], "hi") == 0);
+    expect(results[1].err == CFT_ERR_OK && strcmp(values[1], "deep") == 0);
+    expect(results[2].err == CFT_ERR_POINTER_NOT_FOUND);
+    expect(results[3].err == CFT_ERR_POINTER_IS_MAP);
+    cft_uninit(&h);
+
+    expect(write_data(path, duplicated, sizeof(duplicated)));
+    const char* repeated[BATCH] = {"/dup", "/m/k", "/dup", "/m/x"};
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    expect(cft_get_many(&h, repeated, BATCH, results) == CFT_ERR_OK);
+    expect(results[0].err == CFT_ERR_OK && strcmp(values[0], "1") == 0);
+    expect(results[1].err == CFT_ERR_OK && strcmp(values[1], "v") == 0);
+    expect(results[2].err == CFT_ERR_OK && strcmp(values[2], "1") == 0);
+    expect(results[3].err == CFT_ERR_POINTER_NOT_FOUND);
+    cft_uninit(&h);
+
+    expect(write_data(path, truncated, sizeof(truncated)));
+    const char* early[2] = {"/m/x", "/m/k"};
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    expect(cft_get_many(&h, early, 2, results) == CFT_ERR_OK);
+    expect(results[0].err == CFT_ERR_POINTER_NOT_FOUND);
+    expect(results[1].err == CFT_ERR_OK && strcmp(values[1], "v") == 0);
+    cft_uninit(&h);
+}
+
+// Values are written straight into the caller's buffers, which must hold them whole.
+static void test_into(const char* path) {
+    if (!write_data(path, scalars, sizeof(scalars))) {
+        failures++;
+        return;
+    }
+
+    cft_mode_t modes[] = {CFT_MODE_STREAM, CFT_MODE_MMAP};
+    for (size_t n = 0; n < sizeof(modes) / sizeof(modes[0]); n++) {
+        cft_context_t h = {0};
+        char s[5];
+        uint8_t b[3];
+        size_t len = 0;
+        uint64_t u = 0;
+        expect(cft_init_mode(&h, path, modes[n]) == CFT_ERR_OK);
+        expect(cft_get_sz_into(&h, "/s", s, sizeof(s)) == CFT_ERR_OK && strcmp(s, "text") == 0);
+        expect(cft_get_sz_into(&h, "/s", s, sizeof(s) - 1) == CFT_ERR_INSUFFICIENT_BUFFER);
+        expect(cft_get_bytes_into(&h, "/b", b, sizeof(b), &len) == CFT_ERR_OK && len == 3 && b[0] == 0 && b[2] == 2);
+        expect(cft_get_bytes_into(&h, "/b", b, sizeof(b) - 1, &len) == CFT_ERR_INSUFFICIENT_BUFFER);
+        expect(cft_get_sz_into(&h, "/b", s, sizeof(s)) == CFT_ERR_WRONG_DATA_TYPE);
+        expect(cft_get_bytes_into(&h, "/s", (uint8_t*)s, sizeof(s), &len) == CFT_ERR_WRONG_DATA_TYPE);
+        expect(cft_get_uint(&h, "/u", &u) == CFT_ERR_OK && u == 300);
+        expect(cft_get_uint(&h, "/s", &u) == CFT_ERR_WRONG_DATA_TYPE);
+        expect(cft_get_sz_into(&h, "/x", s, sizeof(s)) == CFT_ERR_POINTER_NOT_FOUND);
+        cft_uninit(&h);
+    }
+}
+
+// Views point at the values in the CBOR data, and stay valid in mmap mode until the file is written.
+static void test_view(const char* path) {
+    if (!write_data(path, scalars, sizeof(scalars))) {
+        failures++;
+        return;
+    }
+
+    cft_mode_t modes[] = {CFT_MODE_STREAM, CFT_MODE_MMAP};
+    for (size_t n = 0; n < sizeof(modes) / sizeof(modes[0]); n++) {
+        cft_context_t h = {0};
+        cft_view_t s;
+        cft_view_t b;
+        expect(cft_init_mode(&h, path, modes[n]) == CFT_ERR_OK);
+        expect(cft_get_sz_view(&h, "/s", &s) == CFT_ERR_OK && s.len == 4 && memcmp(s.ptr, "text", 4) == 0);
+        expect(cft_get_bytes_view(&h, "/b", &b) == CFT_ERR_OK && b.len == 3 && b.ptr[0] == 0 && b.ptr[2] == 2);
+        if (modes[n] == CFT_MODE_MMAP) {
+            expect(memcmp(s.ptr, "text", 4) == 0);
+        }
+        expect(cft_get_sz_view(&h, "/b", &s) == CFT_ERR_WRONG_DATA_TYPE);
+        expect(cft_get_bytes_view(&h, "/u", &b) == CFT_ERR_WRONG_DATA_TYPE);
+        expect(cft_get_sz_view(&h, "/x", &s) == CFT_ERR_POINTER_NOT_FOUND);
+        cft_uninit(&h);
+    }
+}
+
+// Values written with slack grow and shrink in its room without rewriting the file, unless the set has to be durable.
+static void test_slack(const char* path) {
+    if (!write_sample(path)) {
+        failures++;
+        return;
+    }
+
+    struct stat before;
+    struct stat after;
+    cft_context_t h = {0};
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    cft_use_slack(&h, 16);
+    expect(cft_set_sz(&h, "/c", (const unsigned char*)"h", NULL, 0) == CFT_ERR_OK);
+    expect(cft_set_sz(&h, "/a/n", (const unsigned char*)"n", NULL, 0) == CFT_ERR_OK);
+
+    cft_set_durability(&h, CFT_DURABILITY_NONE);
+    expect(stat(path, &before) == 0);
+    expect(cft_set_sz(&h, "/c", (const unsigned char*)"a longer value", NULL, 0) == CFT_ERR_OK);
+    expect(cft_set_sz(&h, "/a/n", (const unsigned char*)"nnnnnnnnnnnnnnnn", NULL, 0) == CFT_ERR_OK);
+    expect(cft_set_sz(&h, "/c", (const unsigned char*)"short", NULL, 0) == CFT_ERR_OK);
+    expect(stat(path, &after) == 0);
+    expect(after.st_ino == before.st_ino && after.st_size == before.st_size);
+    expect(has_sz(&h, "/c", "short"));
+    expect(has_sz(&h, "/a/n", "nnnnnnnnnnnnnnnn"));
+    expect(has_sz(&h, "/a/b", "x"));
+
+    // Past the slack, the value is rewritten with new slack
+    expect(cft_set_sz(&h, "/c", (const unsigned char*)"a value longer than the slack", NULL, 0) == CFT_ERR_OK);
+    expect(stat(path, &before) == 0);
+    expect(before.st_ino != after.st_ino);
+    expect(cft_set_sz(&h, "/c", (const unsigned char*)"a value longer than the slack+", NULL, 0) == CFT_ERR_OK);
+    expect(stat(path, &after) == 0);
+    expect(after.st_ino == before.st_ino);
+
+    // A durable set only stays in place when the length is kept
+    cft_set_durability(&h, CFT_DURABILITY_DATA);
+    expect(cft_set_sz(&h, "/c", (const unsigned char*)"A VALUE LONGER THAN THE SLACK+", NULL, 0) == CFT_ERR_OK);
+    expect(stat(path, &before) == 0);
+    expect(before.st_ino == after.st_ino);
+    expect(cft_set_sz(&h, "/c", (const unsigned char*)"hi", NULL, 0) == CFT_ERR_OK);
+    expect(stat(path, &after) == 0);
+    expect(after.st_ino != before.st_ino);
+    expect(has_sz(&h, "/c", "hi"));
+    expect(has_sz(&h, "/a/n", "nnnnnnnnnnnnnnnn"));
+    cft_uninit(&h);
+
+    cft_context_t fresh = {0};
+    expect(cft_init(&fresh, path) == CFT_ERR_OK);
+    expect(has_sz(&fresh, "/c", "hi"));
+    expect(has_sz(&fresh, "/a/n", "nnnnnnnnnnnnnnnn"));
+    cft_uninit(&fresh);
+}
+
+struct stream {
+    size_t pos;   ///< Number of bytes read so far
+    size_t end;   ///< Number of bytes the stream has
+};
+
+// A value far larger than MAX_DATA_LEN, read in uneven chunks
+static size_t read_stream(void* user, uint8_t* buf, size_t size) {
+    struct stream* st = user;
+    size_t n = st->end - st->pos;
+    n = n < size ? n : size;
+    n = n < 1000 ? n : 1000;
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = (uint8_t)((st->pos + i) % 251);
+    }
+    st->pos += n;
+    return n;
+}
+
+// A streamed byte string is written whole, and a stream that ends early leaves the CBOR data as it was.
+static void test_stream(const char* path) {
+    if (!write_sample(path)) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    cft_view_t view;
+    struct stream st = {0, STREAM_LEN};
+    expect(cft_init_mode(&h, path, CFT_MODE_MMAP) == CFT_ERR_OK);
+    expect(cft_set_bytes_stream(&h, "/a/blob", STREAM_LEN, read_stream, &st) == CFT_ERR_OK);
+    expect(st.pos == STREAM_LEN);
+    expect(cft_get_bytes_view(&h, "/a/blob", &view) == CFT_ERR_OK && view.len == STREAM_LEN);
+    bool same = view.len == STREAM_LEN;
+    for (size_t i = 0; same && i < view.len; i++) {
+        same = view.ptr[i] == i % 251;
+    }
+    expect(same);
+    expect(has_sz(&h, "/a/b", "x"));
+    expect(has_sz(&h, "/c", "hi"));
+
+    struct stat before;
+    struct stat after;
+    expect(stat(path, &before) == 0);
+    st = (struct stream){0, 10};
+    expect(cft_set_bytes_stream(&h, "/c", 20, read_stream, &st) == CFT_ERR_READ_STREAM_ERROR);
+    expect(stat(path, &after) == 0);
+    expect(after.st_ino == before.st_ino && after.st_size == before.st_size);
+    expect(has_sz(&h, "/c", "hi"));
+    expect(cft_get_bytes_view(&h, "/a/blob", &view) == CFT_ERR_OK && view.len == STREAM_LEN);
+    cft_uninit(&h);
+}
+
+// A loaded tree answers like the CBOR data, follows the context's own changes, and ignores the others until
+// it is loaded again.
+static void test_tree(const char* path) {
+    if (!write_data(path, nested, sizeof(nested))) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    uint64_t u = 0;
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    expect(cft_load(&h) == CFT_ERR_OK);
+    expect(h.tree.valid);
+    expect(has_sz(&h, "/c", "hi"));
+    expect(has_sz(&h, "/m/d/c", "deep"));
+    expect(is_missing(&h, "/m/x"));
+    expect(strcmp(h.insertion_map_pointer, "/m/") == 0);
+    cft_get_sz(&h, "/m/d");
+    expect(h.err == CFT_ERR_POINTER_IS_MAP);
+    cft_get_sz(&h, "/c/x");
+    expect(h.err == CFT_ERR_WRONG_DATA_TYPE);
+    expect(cft_get_uint(&h, "/c", &u) == CFT_ERR_WRONG_DATA_TYPE);
+
+    expect(cft_set_sz(&h, "/m/x", (const unsigned char*)"new", NULL, 0) == CFT_ERR_OK);
+    expect(has_sz(&h, "/m/x", "new"));
+    expect(h.tree.valid);
+
+    cft_context_t other = {0};
+    expect(cft_init(&other, path) == CFT_ERR_OK);
+    expect(cft_set_sz(&other, "/c", (const unsigned char*)"other", NULL, 0) == CFT_ERR_OK);
+    cft_uninit(&other);
+    expect(has_sz(&h, "/c", "hi"));
+    expect(cft_load(&h) == CFT_ERR_OK);
+    expect(has_sz(&h, "/c", "other"));
+
+    cft_unload(&h);
+    expect(!h.tree.valid);
+    expect(has_sz(&h, "/m/x", "new"));
+    cft_uninit(&h);
+}
+
+// Every child of a wide map is found among its siblings sorted by key hash, whatever order they were written in.
+static void test_wide_tree(const char* path) {
+    if (!write_sample(path)) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    char pointer[32];
+    char value[32];
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    cft_set_durability(&h, CFT_DURABILITY_NONE);
+    expect(cft_txn_begin(&h) == CFT_ERR_OK);
+    for (int n = 0; n < WIDE_KEYS; n++) {
+        snprintf(pointer, sizeof(pointer), "/w/k%d", n);
+        snprintf(value, sizeof(value), "v%d", n);
+        expect(cft_txn_set_sz(&h, pointer, (const unsigned char*)value) == CFT_ERR_OK);
+    }
+    expect(cft_txn_commit(&h) == CFT_ERR_OK);
+
+    expect(cft_load(&h) == CFT_ERR_OK);
+    bool found = true;
+    for (int n = 0; n < WIDE_KEYS; n++) {
+        snprintf(pointer, sizeof(pointer), "/w/k%d", n);
+        snprintf(value, sizeof(value), "v%d", n);
+        found = found && has_sz(&h, pointer, value);
+    }
+    expect(found);
+    expect(is_missing(&h, "/w/k"));
+    expect(is_missing(&h, "/w/k1000"));
+    expect(has_sz(&h, "/a/b", "x"));
+    cft_uninit(&h);
+}
+
+// List the children of the map of pointer as "key=value " items, maps and arrays given by their size. Return the
+// error that stopped the listing, if any.
+static cft_err_t list_children(cft_context_t* h, const char* pointer, char* out, size_t size) {
+    cft_iter_t it;
+    const char* key;
+    cbor_item_t* value;
+    size_t len = 0;
+    out[0] = '\0';
+    if (cft_iter_open(h, &it, pointer) != CFT_ERR_OK) {
+        return h->err;
+    }
+
+    while (len < size && cft_iter_next(&it, &key, &value)) {
+        if (value == NULL) {
+            len += snprintf(out + len, size - len, "%s=? ", key != NULL ? key : "?");
+        } else if (cbor_isa_string(value)) {
+            len += snprintf(out + len, size - len, "%s=%s ", key, (const char*)cbor_string_handle(value));
+        } else if (cbor_typeof(value) == CBOR_TYPE_MAP) {
+            len += snprintf(out + len, size - len, "%s={%zu} ", key, value->metadata.map_metadata.end_ptr);
+        } else if (cbor_typeof(value) == CBOR_TYPE_ARRAY) {
+            len += snprintf(out + len, size - len, "%s=[%zu] ", key, value->metadata.array_metadata.end_ptr);
+        } else {
+            len += snprintf(out + len, size - len, "%s=? ", key);
+        }
+    }
+
+    cft_err_t err = h->err;
+    cft_iter_close(&it);
+    return err;
+}
+
+// Children come in the order of the CBOR data, then those only the log has, and iterating never writes the file.
+static void test_iter(const char* path) {
+    char log_path[MAX_PATH_LEN + sizeof(LOG_FILE_SUFFIX)];
+    snprintf(log_path, sizeof(log_path), "%s%s", path, LOG_FILE_SUFFIX);
+    remove(log_path);
+    if (!write_data(path, nested, sizeof(nested))) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    char out[256];
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    expect(list_children(&h, "", out, sizeof(out)) == CFT_ERR_OK && strcmp(out, "m={2} l=[2] c=hi ") == 0);
+    expect(list_children(&h, "/m", out, sizeof(out)) == CFT_ERR_OK && strcmp(out, "c=in d={1} ") == 0);
+    expect(list_children(&h, "/c", out, sizeof(out)) == CFT_ERR_WRONG_DATA_TYPE);
+    expect(list_children(&h, "/x", out, sizeof(out)) == CFT_ERR_POINTER_NOT_FOUND);
+
+    cft_iter_t it;
+    const char* key;
+    cbor_item_t* value;
+    expect(cft_iter_open(&h, &it, "") == CFT_ERR_OK);
+    expect(cft_iter_next(&it, &key, &value) && strcmp(key, "m") == 0);
+    expect(cft_set_sz(&h, "/c", (const unsigned char*)"changed", NULL, 0) == CFT_ERR_OK);
+    expect(!cft_iter_next(&it, &key, &value) && h.err == CFT_ERR_DATA_CHANGED);
+    cft_iter_close(&it);
+
+    struct stat before;
+    struct stat after;
+    expect(stat(path, &before) == 0);
+    expect(cft_use_log(&h, true) == CFT_ERR_OK);
+    expect(cft_erase(&h, "/c") == CFT_ERR_OK);
+    expect(cft_set_sz(&h, "/m/x", (const unsigned char*)"new", NULL, 0) == CFT_ERR_OK);
+    expect(cft_set_sz(&h, "/z/y", (const unsigned char*)"logged", NULL, 0) == CFT_ERR_OK);
+    expect(cft_erase(&h, "/m/d") == CFT_ERR_OK);
+    expect(list_children(&h, "", out, sizeof(out)) == CFT_ERR_OK && strcmp(out, "m={2} l=[2] z={1} ") == 0);
+    expect(list_children(&h, "/m", out, sizeof(out)) == CFT_ERR_OK && strcmp(out, "c=in x=new ") == 0);
+    expect(list_children(&h, "/z", out, sizeof(out)) == CFT_ERR_OK && strcmp(out, "y=logged ") == 0);
+    expect(stat(path, &after) == 0);
+    expect(after.st_ino == before.st_ino && after.st_size == before.st_size);
+    expect(after.st_mtim.tv_sec == before.st_mtim.tv_sec && after.st_mtim.tv_nsec == before.st_mtim.tv_nsec);
+    expect(stat(log_path, &after) == 0);
+
+    expect(cft_compact(&h) == CFT_ERR_OK);
+    expect(cft_use_log(&h, false) == CFT_ERR_OK);
+    expect(list_children(&h, "/m", out, sizeof(out)) == CFT_ERR_OK && strcmp(out, "x=new c=in ") == 0);
+    expect(list_children(&h, "/z", out, sizeof(out)) == CFT_ERR_OK && strcmp(out, "y=logged ") == 0);
+    cft_uninit(&h);
+}
+
+// Changes logged then folded into the CBOR data, including a map erased and set to a string again.
+static void test_log_replay(const char* path) {
+    char log_path[MAX_PATH_LEN + sizeof(LOG_FILE_SUFFIX)];
+    snprintf(log_path, sizeof(log_path), "%s%s", path, LOG_FILE_SUFFIX);
+    remove(log_path);
+    if (!write_sample(path)) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    expect(cft_use_log(&h, true) == CFT_ERR_OK);
+    expect(cft_erase(&h, "/a") == CFT_ERR_OK);
+    expect(cft_set_sz(&h, "/a", (const unsigned char*)"s", NULL, 0) == CFT_ERR_OK);
+    expect(cft_set_sz(&h, "/n/m", (const unsigned char*)"1", NULL, 0) == CFT_ERR_OK);
+    expect(cft_erase(&h, "/n") == CFT_ERR_OK);
+    expect(cft_set_sz(&h, "/c", (const unsigned char*)"hello", NULL, 0) == CFT_ERR_OK);
+    expect(has_sz(&h, "/a", "s"));
+
+    expect(cft_compact(&h) == CFT_ERR_OK);
+    struct stat st;
+    expect(stat(log_path, &st) != 0);
+
+    expect(cft_use_log(&h, false) == CFT_ERR_OK);
+    expect(has_sz(&h, "/a", "s"));
+    expect(has_sz(&h, "/c", "hello"));
+    expect(is_missing(&h, "/n"));
+    cft_uninit(&h);
+}
+
+// Queued changes are written by a commit, and dropped by an abort.
+static void test_txn(const char* path) {
+    if (!write_sample(path)) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+
+    expect(cft_txn_begin(&h) == CFT_ERR_OK);
+    expect(cft_txn_set_sz(&h, "/c", (const unsigned char*)"aborted") == CFT_ERR_OK);
+    expect(cft_txn_erase(&h, "/a") == CFT_ERR_OK);
+    cft_txn_abort(&h);
+    expect(cft_txn_commit(&h) == CFT_ERR_NO_TRANSACTION);
+    expect(has_sz(&h, "/c", "hi"));
+    expect(has_sz(&h, "/a/b", "x"));
+
+    expect(cft_txn_begin(&h) == CFT_ERR_OK);
+    expect(cft_txn_set_sz(&h, "/c", (const unsigned char*)"committed") == CFT_ERR_OK);
+    expect(cft_txn_set_sz(&h, "/d/e", (const unsigned char*)"new") == CFT_ERR_OK);
+    expect(cft_txn_erase(&h, "/a") == CFT_ERR_OK);
+    expect(cft_txn_commit(&h) == CFT_ERR_OK);
+    expect(has_sz(&h, "/c", "committed"));
+    expect(has_sz(&h, "/d/e", "new"));
+    expect(is_missing(&h, "/a"));
+    cft_uninit(&h);
+}
+
+// Erasing a key that doesn't exist fails before anything is written.
+static void test_erase_missing(const char* path) {
+    if (!write_sample(path)) {
+        failures++;
+        return;
+    }
+
+    struct stat before;
+    struct stat after;
+    expect(stat(path, &before) == 0);
+
+    cft_context_t h = {0};
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    expect(cft_erase(&h, "/nope") == CFT_ERR_POINTER_NOT_FOUND);
+    expect(cft_erase(&h, "/a/nope") == CFT_ERR_POINTER_NOT_FOUND);
+    cft_uninit(&h);
+
+    expect(stat(path, &after) == 0);
+    expect(after.st_ino == before.st_ino);
+    expect(after.st_size == before.st_size);
+    expect(after.st_mtim.tv_sec == before.st_mtim.tv_sec && after.st_mtim.tv_nsec == before.st_mtim.tv_nsec);
+}
+
+// A document keeps the CBOR data it was opened with, even when a value is written in place over the file.
+static void test_doc_snapshot(const char* path) {
+    if (!write_sample(path)) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    cft_set_durability(&h, CFT_DURABILITY_NONE);
+    expect(cft_set_sz(&h, "/c", (const unsigned char*)"ab", NULL, 0) == CFT_ERR_OK);
+
+    cft_mode_t modes[] = {CFT_MODE_STREAM, CFT_MODE_MMAP};
+    for (size_t n = 0; n < sizeof(modes) / sizeof(modes[0]); n++) {
+        cft_doc_t* doc;
+        char v[32];
+        struct stat before;
+        struct stat after;
+        expect(cft_doc_open(&doc, path, modes[n]) == CFT_ERR_OK);
+        expect(stat(path, &before) == 0);
+        expect(cft_set_sz(&h, "/c", n == 0 ? (const unsigned char*)"cd" : (const unsigned char*)"ab", NULL, 0) == CFT_ERR_OK);
+        expect(stat(path, &after) == 0);
+        expect(after.st_ino == before.st_ino);
+
+        cft_cursor_t cur;
+        cft_cursor_init(&cur, doc);
+        cft_doc_unref(doc);
+        expect(cft_cursor_get_sz_into(&cur, "/c", v, sizeof(v)) == CFT_ERR_OK && strcmp(v, n == 0 ? "ab" : "cd") == 0);
+        cft_cursor_uninit(&cur);
+    }
+    cft_uninit(&h);
+}
+
+// Cursors find values through the index of their document, with the errors of a scan, and scan the documents
+// the index can't hold.
+static void test_cursor(const char* path) {
+    unsigned char data[sizeof(nested) + 3 + MAX_POINTER_LEN + 1];
+    memcpy(data, nested, sizeof(nested));
+    size_t len = sizeof(nested);
+    for (int indexed = 1; indexed >= 0; indexed--) {
+        if (!indexed) {
+            // One more key, too long for a JSON Pointer
+            data[0]++;
+            data[len++] = 0x79;
+            data[len++] = MAX_POINTER_LEN >> 8;
+            data[len++] = MAX_POINTER_LEN & 0xff;
+            memset(data + len, 'k', MAX_POINTER_LEN);
+            len += MAX_POINTER_LEN;
+            data[len++] = 0x00;
+        }
+
+        cft_doc_t* doc;
+        char v[32];
+        uint64_t u;
+        if (!write_data(path, data, len) || cft_doc_open(&doc, path, CFT_MODE_MMAP) != CFT_ERR_OK) {
+            failures++;
+            return;
+        }
+        expect(doc->index.valid == indexed);
+
+        cft_cursor_t cur;
+        cft_cursor_init(&cur, doc);
+        cft_doc_unref(doc);
+        expect(cft_cursor_get_sz_into(&cur, "/c", v, sizeof(v)) == CFT_ERR_OK && strcmp(v, "hi") == 0);
+        expect(cft_cursor_get_sz_into(&cur, "/m/d/c", v, sizeof(v)) == CFT_ERR_OK && strcmp(v, "deep") == 0);
+        expect(cft_cursor_get_sz_into(&cur, "/m/d/c", v, 4) == CFT_ERR_INSUFFICIENT_BUFFER);
+        expect(cft_cursor_get_sz_into(&cur, "/m", v, sizeof(v)) == CFT_ERR_POINTER_IS_MAP);
+        expect(cft_cursor_get_sz_into(&cur, "/m/x", v, sizeof(v)) == CFT_ERR_POINTER_NOT_FOUND);
+        expect(cft_cursor_get_sz_into(&cur, "/x/y", v, sizeof(v)) == CFT_ERR_POINTER_NOT_FOUND);
+        expect(cft_cursor_get_sz_into(&cur, "/c/x/y", v, sizeof(v)) == CFT_ERR_WRONG_DATA_TYPE);
+        expect(strstr(cur.err_msg, "\"/c\"") != NULL);
+        expect(cft_cursor_get_uint(&cur, "/c", &u) == CFT_ERR_WRONG_DATA_TYPE);
+        cft_cursor_uninit(&cur);
+    }
+}
+
+struct reader {
+    cft_reloader_t* r;
+    bool* stop;
+    int bad;
+};
+
+// Both keys are always set together, so any snapshot has the same value for them.
+static void* read_snapshots(void* arg) {
+    struct reader* rd = arg;
+    char v[32];
+    char w[32];
+    while (!__atomic_load_n(rd->stop, __ATOMIC_ACQUIRE)) {
+        cft_doc_t* doc = cft_reloader_acquire(rd->r);
+        cft_cursor_t cur;
+        cft_cursor_init(&cur, doc);
+        cft_doc_unref(doc);
+        if (cft_cursor_get_sz_into(&cur, "/v", v, sizeof(v)) != CFT_ERR_OK ||
+            cft_cursor_get_sz_into(&cur, "/w", w, sizeof(w)) != CFT_ERR_OK || strcmp(v, w) != 0) {
+            rd->bad++;
+        }
+        cft_cursor_uninit(&cur);
+    }
+
+    return NULL;
+}
+
+// Readers acquire snapshots while the CBOR data is rewritten and reloaded under them.
+static void test_reloader(const char* path) {
+    if (!write_sample(path)) {
+        failures++;
+        return;
+    }
+
+    cft_context_t h = {0};
+    expect(cft_init(&h, path) == CFT_ERR_OK);
+    cft_set_durability(&h, CFT_DURABILITY_NONE);
+    expect(cft_txn_begin(&h) == CFT_ERR_OK);
+    expect(cft_txn_set_sz(&h, "/v", (const unsigned char*)"0") == CFT_ERR_OK);
+    expect(cft_txn_set_sz(&h, "/w", (const unsigned char*)"0") == CFT_ERR_OK);
+    expect(cft_txn_commit(&h) == CFT_ERR_OK);
+
+    cft_reloader_t r;
+    if (cft_reloader_init(&r, path, CFT_MODE_MMAP) != CFT_ERR_OK) {
+        printf("FAIL %s:%d: cft_reloader_init: %s\n", __FILE__, __LINE__, r.err_msg);
+        failures++;
+        cft_uninit(&h);
+        return;
+    }
+
+    bool stop = false;
+    struct reader readers[READERS];
+    pthread_t threads[READERS];
+    for (int n = 0; n < READERS; n++) {
+        readers[n] = (struct reader){&r, &stop, 0};
+        pthread_create(&threads[n], NULL, read_snapshots, &readers[n]);
+    }
+
+    char v[32];
+    for (int n = 1; n <= RELOADS; n++) {
+        snprintf(v, sizeof(v), "%d", n);
+        expect(cft_txn_begin(&h) == CFT_ERR_OK);
+        expect(cft_txn_set_sz(&h, "/v", (const unsigned char*)v) == CFT_ERR_OK);
+        expect(cft_txn_set_sz(&h, "/w", (const unsigned char*)v) == CFT_ERR_OK);
+        expect(cft_txn_commit(&h) == CFT_ERR_OK);
+        expect(cft_reloader_reload(&r) == CFT_ERR_OK);
+    }
+
+    __atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+    for (int n = 0; n < READERS; n++) {
+        pthread_join(threads[n], NULL);
+        expect(readers[n].bad == 0);
+    }
+
+    cft_doc_t* doc = cft_reloader_acquire(&r);
+    cft_cursor_t cur;
+    cft_cursor_init(&cur, doc);
+    cft_doc_unref(doc);
+    expect(cft_cursor_get_sz_into(&cur, "/v", v, sizeof(v)) == CFT_ERR_OK && atoi(v) == RELOADS);
+    cft_cursor_uninit(&cur);
+
+    cft_reloader_uninit(&r);
+    cft_uninit(&h);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        printf("Usage: streaming_test <scratch file>\n");
+        return 1;
+    }
+
+    const char* path = argv[1];
+    test_skip(path);
+    test_index(path);
+    test_index_file(path);
+    test_get_many(path);
+    test_into(path);
+    test_view(path);
+    test_slack(path);
+    test_stream(path);
+    test_tree(path);
+    test_wide_tree(path);
+    test_iter(path);
+    test_log_replay(path);
+    test_txn(path);
+    test_erase_missing(path);
+    test_doc_snapshot(path);
+    test_cursor(path);
+    test_reloader(path);
+
+    remove(path);
+    if (failures > 0) {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("all checks passed\n");
+    return 0;
+}